@@ -4,21 +4,60 @@
 // feature test macros ( getline() )
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <termios.h>
 #include <time.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 1
+#define KILO_BLOCK_ROWS 128 // rows stored in a single node of the row tree
+#define KILO_INDEX_THREADS 8
+#define KILO_HL_CHECKPOINT 256 // rows between saved highlighter states
+#define KILO_HL_LOOKAHEAD 32   // rows highlighted past the end of the screen
+#define KILO_HL_SYNC 8192      // rows past the frontier scanned by the UI, further by a worker thread
+#define KILO_HL_PATCH 64       // cells highlighted again around an edit ( else the whole row )
+#define KILO_SEPARATORS ",.()+-/*=~%<>[];\"" // separators besides the spaces ( unless a syntax file has its own )
+#define KILO_SYNTAX_DIR ".kilo/syntax" // syntax files under $HOME ( or in $KILO_SYNTAX_DIR )
+#define KILO_LONG_LINE (1 << 16) // longer rows are rendered and highlighted only where they are shown
+#define KILO_LONG_MARK 4096      // chars between saved highlighter states of a long row
+#define KILO_LONG_MARGIN 1024    // cells rendered at the sides of the screen for a long row
+#define KILO_INDEX_CHUNK (16 << 20) // bytes of file for each thread indexing the lines
+#define KILO_INPUT_BUF 4096 // bytes of the input ring buffer
+#define KILO_PASTE_WAIT 1000 // ms without input that end a paste ( if <esc>[201~ never arrives )
+#define KILO_SAVE_IOV 1024  // buffers for each writev() when saving ( 2 for every row )
+#define KILO_FIND_ROWS 65536 // buffers with more rows are searched by worker threads
+#define KILO_FIND_CHUNK (1 << 20) // bytes of mapped lines searched by a worker at a time
+#define RE_DFA_STATES 1024 // cached states of a lazy DFA ( flushed when full )
+#define KILO_UNDO_BYTES (8 << 20) // memory of the undo journal ( the oldest edits are dropped )
+#define KILO_SLAB_CHUNK (1 << 20) // bytes taken from malloc() at a time for the row buffers
+#define KILO_SLAB_MAX (64 << 10)  // bigger row buffers are malloc()ed on their own
+#define KILO_SLAB_CLASSES 48      // size classes up to KILO_SLAB_MAX
+#define KILO_MSG_SECONDS 5  // time the status message stays on screen
+#define KILO_BENCH_ROWS 50     // screen of the benchmarks ( KILO_BENCH set, no terminal )
+#define KILO_BENCH_COLS 160
+#define KILO_BENCH_FRAMES 2000 // frames drawn by the render benchmark
+#define KILO_BENCH_LINE 200000 // bytes of the long lines searched by the find benchmark
+#define KILO_BENCH_RUNS 10     // searches of the file timed together
 // mirrors what ctrl_key does in terminal : sets the upper 3 bit to 0 (0001.1111 = 0x1f)
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -30,7 +69,26 @@
 /********* Prototypes ****************************************************/
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
+void editorResize();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+struct erow;
+void editorInitRow(struct erow *row, char *s, size_t len);
+void editorRenderRow(struct erow *row);
+void editorRowDetach(struct erow *row);
+struct saveSeg;
+int editorSnapshot(int from, int to, struct saveSeg **segs);
+void editorKeptFree();
+char *editorRowRender(struct erow *row);
+int editorRowCxToRx(struct erow *row, int cx);
+int editorRowRxToCx(struct erow *row, int rx);
+int editorHighlightRestart(char c);
+void hlRunPush(unsigned char *runs, int *n, int len, int hl);
+void editorSaveCheck(int wait);
+void editorSyntaxCheck();
+void editorFindCheck();
+void undoRecord(int type, int row, int col, const char *s, int len);
+int editorRowIndex(struct erow *row);
+void initEditor();
 
 
 enum editorKey 
@@ -44,7 +102,9 @@ enum editorKey
     HOME_KEY, // fn + left
     END_KEY,  // fn + right
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE_START, // <esc>[200~ ( bracketed paste )
+    PASTE_END    // <esc>[201~
 };
 
 enum editorHighlight
@@ -62,20 +122,107 @@ enum editorHighlight
     HL_MATCH
 };
 
+// cells on screen have a HL_* value or one of these
+enum editorStyle
+{
+    STYLE_CTRL = HL_MATCH + 1, // control chars ( reverse video )
+    STYLE_STATUS,
+    STYLE_COUNT
+};
+
 
 /*************************************************************************/
 /********* Data **********************************************************/ 
+// state of the highlighter at a place where it can start again ( and at the row ends: 
+// a comment or a string continued with "\" are still open at the next row )
+struct hlState
+{
+    unsigned char in_comment;
+    unsigned char in_string; // quote that opened the string ( 0 = none )
+};
+
+struct hlMark
+{
+    int at; // cx
+    struct hlState st;
+};
+
+// a row longer than KILO_LONG_LINE has no render and no runs: the highlighter state is saved 
+// every KILO_LONG_MARK chars, render and hl are made only for a window of cells around the screen
+struct longRow
+{
+    struct hlMark *marks; // marks[0] is the start of the row
+    int nmarks;
+    int markCap;
+    int scanned;          // marks are known up to this cx ( the row end state from here on )
+    struct hlState st;    // state at "scanned"
+    int winValid;
+    int winColored;       // the window has runs ( the row was highlighted )
+    int winFrom;          // first cell of the window
+    int winLen;
+    char *winText;
+    unsigned char *winRuns;
+    int winRunsLen;
+    int winCap;
+};
+
 typedef struct erow 
 {
-    int idx; // only for ml comments
+    struct rowBlock *blk; // block holding the row (its index comes from the tree)
     int size;
     int rendersize;
     char *chars;    // "/t"
-    char *render;   // "    "
-    unsigned char *hl; // highlight 0-255
-    int hl_open_comment;
+    char *render;   // "    " ( NULL when the same as chars: no tabs )
+    int *tabs;      // for every tab: its cx and the rx after it ( cx <-> rx without walking the row )
+    int ntabs;
+    struct longRow *wide; // rows longer than KILO_LONG_LINE ( else NULL )
+    unsigned char *hl; // highlight in runs of 2 bytes: length 1-255, HL_* ( valid only if hl_valid )
+    int hlRuns;        // the cells after the last run are HL_NORMAL
+    struct hlState hl_in;  // highlighter state at the start when highlighted
+    struct hlState hl_out; // and at the end
+    int hl_valid;
+    unsigned int snapGen; // chars shared with the snapshot of this generation ( save or highlighter )
 } erow;
 
+// memory of the row buffers ( chars, render, hl ): size classes with a free list each, 
+// carved one after the other from big chunks. A buffer is freed with its size, that gives its class
+struct rowHeap
+{
+    char *chunk;  // free part of the current chunk
+    size_t left;
+    void *freeList[KILO_SLAB_CLASSES];
+};
+
+// the rows are kept in a rope of line blocks: a treap ordered by position where every node 
+// holds up to KILO_BLOCK_ROWS rows and the n° of rows of its subtree. Insert, delete and 
+// lookup of a line are O(log n) and only move rows inside a single block.
+// A block can also be a range of lines of the mmap()ed file not yet turned into rows
+struct rowBlock
+{
+    struct rowBlock *left;
+    struct rowBlock *right;
+    struct rowBlock *parent;
+    int prio;     // heap priority (random) keeps the tree balanced
+    int count;    // rows in this subtree
+    int nrows;    // rows in this block
+    int mapFirst; // first line (in E.lineIndex) of a mapped block
+    erow *rows;   // NULL while the block is only mapped lines
+};
+
+// keywords compiled in a trie: one node for every prefix, the edges are a table indexed by
+// node and by the chars used in the keywords. A node where a keyword ends has its class 
+// (HL_KEYWORD1..4) and the keyword position in the list
+struct kwTrie
+{
+    unsigned char alpha[256]; // char -> column of the edge table ( 0 = not in any keyword )
+    int nalpha;
+    int nnodes;
+    int *next;                // nnodes * nalpha edges ( 0 = none, node 0 is the root )
+    unsigned char *hlClass;   // 0 = no keyword ends here
+    int *order;
+    int maxLen;               // longest keyword: how far the matcher looks ahead
+};
+
 struct editorSyntax 
 {
     char *filetype;
@@ -85,6 +232,251 @@ struct editorSyntax
     char *multiline_comment_start;
     char *multiline_comment_end;
     int flags;
+    struct kwTrie *trie; // built from keywords when the syntax is selected ( or loaded with it )
+    unsigned char sep[32]; // bitmap of the separators
+};
+
+// filename extension -> syntax ( open addressing )
+struct syntaxExt
+{
+    const char *ext;
+    struct editorSyntax *syntax;
+};
+
+// a syntax compiled in a blob of packed tables ( the cache file of the syntax files is a header 
+// and one of these for each syntax ). Offsets are from the start of the blob ( 0 = none )
+struct syntaxPacked
+{
+    int filetype;
+    int filematch; // patterns one after the other, an empty one at the end
+    int comment[3]; // single line, multiline start and end
+    int flags;
+    int nalpha;
+    int nnodes;
+    int maxLen;
+    int next;      // tables of the keyword trie
+    int hlClass;
+    int order;
+    unsigned char alpha[256];
+    unsigned char sep[32];
+};
+
+struct syntaxCacheHead
+{
+    char magic[8];
+    unsigned long long key; // hash of the names, mtimes and sizes of the syntax files
+    int size;
+    int nsyntax;            // a struct syntaxPacked for each one after this
+};
+
+// part of the rows of a snapshot: a block of loaded rows, or lines of the mapped file
+struct saveSeg
+{
+    int mapFirst;
+    int nrows;
+    struct iovec *lines; // chars of the loaded rows ( NULL = mapped lines )
+};
+
+// a save running in a writer thread
+struct saveJob
+{
+    char *filename; // the target, symlinks resolved
+    char *tmp;      // temp file renamed over the target ( NULL = written in place )
+    int fd;
+    struct saveSeg *segs;
+    int nsegs;
+    int nrows;
+    int rowsDone; // progress, written by the writer thread
+    int done;
+    int err;      // errno of the failure ( 0 = saved )
+    size_t written;
+    double secs;
+    int undoPos;  // journal position of the snapshot
+    unsigned int gen; // generation of the snapshot
+    int wake[2];  // pipe: the writer wakes up poll() for progress and at the end
+    int threaded;
+    pthread_t thread;
+};
+
+// chars of a row changed while a snapshot of this generation ( or older ) may still read them
+struct keptChars
+{
+    char *chars;
+    size_t size;
+    unsigned int gen;
+};
+
+// the highlighter state of the rows [from, to) followed by a worker thread, on a snapshot of 
+// the rows: the screen is far past the frontier. Any change before "to" cancels it
+struct hlJob
+{
+    int from;           // E.hlFrontier when started
+    int to;
+    struct hlState st;  // state at "from", at "to" when done
+    struct hlState *checkpoints; // of the rows in [from, to) multiple of KILO_HL_CHECKPOINT
+    struct saveSeg *segs;
+    int nsegs;
+    unsigned int gen;   // generation of the snapshot
+    int cancel;
+    int done;
+    int wake[2];        // pipe: wakes up poll() when done
+    int threaded;
+    pthread_t thread;
+};
+
+// regex of the search, parsed in a tree of nodes
+enum reOp { RE_SET, RE_CAT, RE_ALT, RE_STAR, RE_PLUS, RE_QUEST, RE_BOL, RE_EOL, RE_EMPTY };
+
+struct reNode
+{
+    int op;
+    int a, b;              // operands
+    unsigned char set[32]; // bytes matched by RE_SET
+};
+
+// Thompson NFA: a state moves on a byte of "set" to "out", or on nothing to "eps"
+struct reState
+{
+    unsigned char set[32];
+    int out;
+    int eps[2];
+    int assert; // RE_AT_START, RE_AT_END: eps[0] only at the start / end of the scanned text
+};
+
+struct reNFA
+{
+    struct reState *s;
+    int n;
+    int cap;
+    int start;
+    int match;
+};
+
+// compiled once for every query, read only after: shared by the search threads
+struct regex
+{
+    struct reNode *node;
+    int nnodes;
+    int cap;
+    const char *p; // parser position
+    int err;
+    struct reNFA fwd;
+    struct reNFA rev; // reversed regex ( finds where the matches start )
+    int firstByte;    // every match starts with this byte ( -1 = not known ): memchr() finds the lines to try
+};
+
+// lazy DFA: a state is a set of NFA states, built the first time it's reached. 
+// One for each thread ( the cache changes while matching )
+struct reDFA
+{
+    struct reNFA *nfa;
+    int unanchored;       // a match can start at every position
+    int nstates;
+    int *next;            // RE_DFA_STATES * 256 transitions ( -1 = not built yet )
+    unsigned char *flags; // RE_MATCH, RE_MATCH_END, RE_DEAD
+    int *setStart;        // NFA states of every DFA state ( in "sets" )
+    int *setLen;
+    int *sets;
+    int setsLen;
+    int setsCap;
+    int *hash;            // set -> DFA state + 1 ( 0 = empty slot )
+    int start[2];         // first state ( [1] = at the start of the text ), -1 = not built
+    int *in, *out, *tmp, *stack, *mark; // closure work space
+    int gen;
+    int *startSet;        // unanchored: closure of the start, moved with every byte
+    int startLen;
+};
+
+struct reMatcher
+{
+    struct regex *re;
+    struct reDFA fwd;
+    struct reDFA rev;
+    unsigned long long *starts; // bitmap of the positions of the line where a match can start
+    int startsCap;              // words of "starts"
+};
+
+// record of the undo journal
+enum undoType { UNDO_GROUP, UNDO_INSERT, UNDO_DELETE, UNDO_INSERT_ROW, UNDO_DELETE_ROW };
+
+struct undoRec
+{
+    int type;
+    int row;
+    int col;
+    int len;    // bytes after the record
+    int cx, cy; // UNDO_GROUP: cursor after the group ( row, col = before it )
+    int id, before; // UNDO_GROUP: journal position after the group and before it
+};
+
+struct undoStack
+{
+    char *b;
+    size_t len;
+    size_t cap;
+};
+
+struct findMatch
+{
+    int row;
+    int col; // in chars
+    int len;
+};
+
+struct findList
+{
+    struct findMatch *m;
+    int n;
+    int cap;
+};
+
+// a range of rows searched by a worker thread: loaded rows, or lines of the mapped file
+struct findItem
+{
+    int at;      // first row
+    int nrows;
+    int mapFirst;
+    erow *rows;  // NULL = mapped lines
+    struct findList found;
+    int done;
+};
+
+// search of a big buffer split between worker threads, cancelled when the query changes
+struct findJob
+{
+    char *query;
+    int qlen;
+    struct regex *re; // NULL = literal search
+    struct findItem *items;
+    int nitems;
+    int next;    // next item to take
+    int ndone;
+    int cancel;
+    int merged;  // items already moved in the results ( by the main thread )
+    int wake[2]; // pipe: wakes up poll() when there are new results
+    int nthreads;
+    pthread_t threads[KILO_INDEX_THREADS];
+};
+
+// the search in progress: every occurrence of the query, ordered by row and column
+struct findResults
+{
+    char *query;
+    int qlen;
+    struct findList list;
+    int regex;           // regex mode ( Ctrl-R in the prompt )
+    struct regex *re;    // compiled query ( NULL = literal, or a bad regex )
+    int cur;             // match the cursor is on
+    struct findJob *job; // results still coming from the workers ( NULL = complete )
+};
+
+// what is on screen: a char and a style for every cell
+struct editorGrid
+{
+    int rows;
+    int cols;
+    char *chars;
+    unsigned char *style;
 };
 
 struct editorConfig 
@@ -96,12 +488,58 @@ struct editorConfig
     int screenRows;
     int screenCols;
     int numTextRows;
-    erow *row;
+    struct rowBlock *rowTree; // root of the row blocks tree
+    struct rowHeap heap;      // buffers of the rows
+    char *map;                // file opened with mmap() ( read only ), a copy once saved in place
+    size_t mapSize;
+    size_t *lineIndex;        // offset in the map of every line ( + 1 past the last )
+    int hlFrontier;           // highlighter state known for the rows before this
+    struct hlState hlState;   // highlighter state at the start of row hlFrontier
+    struct hlState *hlCheckpoint; // state every KILO_HL_CHECKPOINT rows (before the frontier)
+    int hlCheckpointCap;
+    unsigned char *hlLine;    // hl of every cell of the row being highlighted
+    int hlLineCap;
+    struct hlJob *hlJob;      // state scan in a worker thread ( NULL = none )
+    int hlEvent;              // the worker is done
     int dirty;
     char *filename;
     char statusMsg[80];
     time_t statusMsg_time;
+    char inBuf[KILO_INPUT_BUF]; // ring of bytes read from stdin, not yet decoded
+    int inHead;
+    int inLen;
+    int sigFd;       // SIGWINCH delivered as a file descriptor ( -1 = none )
+    int winChanged;
+    struct saveJob *save; // save in progress ( NULL = none )
+    unsigned int snapGen; // generation of the last snapshot of the rows
+    struct keptChars *kept; // old chars still read by a snapshot
+    int nkept;
+    int keptCap;
+    struct editorSyntax *syntaxes; // HLDB and the syntax files
+    int nsyntaxes;
+    struct syntaxExt *syntaxHash;  // filename extension -> syntax
+    int syntaxHashSize;
+    int saveEvent;        // writer thread has something to report
+    int findEvent;        // search workers have new results
+    struct findResults find;
+    struct undoStack undo;
+    struct undoStack redo;
+    size_t undoGroupAt; // offset of the group being recorded
+    int undoOpen;
+    int undoLock;       // not recording ( open, undo, redo )
+    int undoSkip;       // group too big for the journal
+    int undoKind;       // kind of the last key: runs of typing or deleting are one group
+    int undoCx, undoCy; // cursor before the group
+    int undoSeq;        // groups recorded so far ( ids of the groups )
+    int undoPos;        // journal position: id of the last group done ( 0 = none )
+    int undoSaved;      // journal position of the file on disk
     struct editorSyntax *syntax;
+    struct editorGrid frame;  // frame being drawn
+    struct editorGrid shown;  // last frame sent to the terminal
+    int shownValid;
+    int frameStats;  // show the output bytes and allocations of the last frame
+    int frameBytes;
+    int frameAllocs;
     struct termios orig_termios;
 };
 
@@ -135,7 +573,9 @@ struct editorSyntax HLDB[] = {
 	C_HL_extensions,
 	C_HL_keywords,
 	"//", "/*", "*/",
-	HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+	HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+	NULL,
+	{ 0 }
     },
 };
 
@@ -159,6 +599,7 @@ void die(const char *s)
 
 void disableRawMode()
 {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if ( tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1 ) { die("tcsetattr"); }
 }
 
@@ -173,9 +614,10 @@ void enableRawMode()
     raw.c_oflag &= ~(OPOST);
     raw.c_cflag |= (CS8);
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG); 
-    raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1; 
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0; 
     if ( tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) { die("tcsetattr"); }
+    write(STDOUT_FILENO, "\x1b[?2004h", 8); // bracketed paste: the terminal wraps pasted text in <esc>[200~ <esc>[201~
     // FLAGS (Input, Output, Control, Local) :
     // ICANON : Canonical Mode: reading input byte-by-byte instead of line-by-line
     // ISIG : stop of Signals (Ctrl-C SIGNINT)(terminate) (Ctrl-Z SIGTSTP)(suspend)
@@ -188,33 +630,115 @@ void enableRawMode()
     // BRKINT, SIGINT, INPCK, ISTRIP : been conservative (probably already turned off) 
  
     // CONTROL CHARACTERS :
-    // VMIN : sets the minimum number of bytes of input needed before read() can return ( can return also if 0 byte readed )
-    // VTIME :  sets the maximum amount of time to wait before read() returns ( set to 1/10 of a second, or 100 milliseconds )
+    // VMIN : sets the minimum number of bytes of input needed before read() can return
+    // VTIME :  sets the maximum amount of time to wait before read() returns ( 0 = no timer, poll() does the waiting )
+}
+
+// SIGWINCH is blocked and read from a descriptor, so poll() wakes up on resize too
+void enableResizeEvents()
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+
+    E.sigFd = -1;
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) { return; }
+    E.sigFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+// wait up to "timeout" ms ( -1 = forever ) and read all the available input in the ring
+void inputFill(int timeout)
+{
+    struct pollfd fds[5] = { { STDIN_FILENO, POLLIN, 0 }, { E.sigFd, POLLIN, 0 }, { -1, POLLIN, 0 }, { -1, POLLIN, 0 }, { -1, POLLIN, 0 } };
+    if (E.save) { fds[2].fd = E.save->wake[0]; } // negative fds are ignored by poll()
+    if (E.find.job) { fds[3].fd = E.find.job->wake[0]; }
+    if (E.hlJob) { fds[4].fd = E.hlJob->wake[0]; }
+
+    if (poll(fds, 5, timeout) == -1)
+    {
+	if (errno != EINTR) { die("poll"); }
+	return;
+    }
+
+    if (fds[2].revents & POLLIN) { E.saveEvent = 1; }
+    if (fds[3].revents & POLLIN) { E.findEvent = 1; }
+    if (fds[4].revents & POLLIN) { E.hlEvent = 1; }
+
+    if (E.sigFd != -1 && (fds[1].revents & POLLIN))
+    {
+	struct signalfd_siginfo si;
+	while (read(E.sigFd, &si, sizeof(si)) == sizeof(si)) { E.winChanged = 1; }
+    }
+
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+    {
+	int tail = (E.inHead + E.inLen) % KILO_INPUT_BUF;
+	int room = KILO_INPUT_BUF - E.inLen;
+	if (room > KILO_INPUT_BUF - tail) { room = KILO_INPUT_BUF - tail; } // up to the end of the ring
+
+	ssize_t nread = read(STDIN_FILENO, &E.inBuf[tail], room);
+	if (nread == 0) { die("read"); } // terminal gone
+	if (nread == -1 && errno != EAGAIN && errno != EINTR) { die("read"); }
+	if (nread > 0) { E.inLen += nread; }
+    }
+}
+
+// next byte of input, -1 if nothing came in "timeout" ms
+int inputByte(int timeout)
+{
+    if (E.inLen == 0) { inputFill(timeout); }
+    if (E.inLen == 0) { return -1; }
+
+    unsigned char c = E.inBuf[E.inHead];
+    E.inHead = (E.inHead + 1) % KILO_INPUT_BUF;
+    E.inLen--;
+    return c;
+}
+
+// ms before the status message has to disappear ( -1 = no message to wait for )
+int editorInputTimeout()
+{
+    if (E.statusMsg[0] == '\0') { return -1; }
+
+    time_t left = E.statusMsg_time + KILO_MSG_SECONDS - time(NULL);
+    return left > 0 ? (int)left * 1000 : 0;
 }
 
 int editorReadKey()
 {
-    int nread;
-    char c;
-    while((nread = read(STDIN_FILENO, &c, 1)) != 1) 
+    int c;
+    if (E.saveEvent) { editorSaveCheck(0); }
+    if (E.hlEvent) { editorSyntaxCheck(); }
+    while ((c = inputByte(editorInputTimeout())) == -1) // no busy wake up: only input, resize, save or message expiry
     {
-	// in Cygwin, when read() times out it returns -1 with an errno of EAGAIN, instead of just returning 0 
-	if (nread == -1 && errno != EAGAIN) { die("read"); }
+	if (E.saveEvent) { editorSaveCheck(0); }
+	if (E.findEvent) { editorFindCheck(); }
+	if (E.hlEvent) { editorSyntaxCheck(); } // repainted with the colors
+	if (E.winChanged) { editorResize(); }
+	if (time(NULL) - E.statusMsg_time >= KILO_MSG_SECONDS) { E.statusMsg[0] = '\0'; }
+	editorRefreshScreen();
     }
 
-    // Arrows Escape Sequence as a single press
+    // Arrows Escape Sequence as a single press ( the rest of the sequence is already there or arrives in 100ms )
     if (c == '\x1b')
     {
-	char seq[3];
+	int seq[3];
 
-	if (read(STDIN_FILENO, &seq[0], 1) != 1) { return '\x1b'; }
-	if (read(STDIN_FILENO, &seq[1], 1) != 1) { return '\x1b'; }
+	if ((seq[0] = inputByte(100)) == -1) { return '\x1b'; }
+	if ((seq[1] = inputByte(100)) == -1) { return '\x1b'; }
 
 	if (seq[0] == '[')
 	{
 	    if (seq[1] >= '0' && seq[1] <= '9')
 	    {
-		if (read(STDIN_FILENO, &seq[2], 1) != 1) { return '\x1b'; }
+		if ((seq[2] = inputByte(100)) == -1) { return '\x1b'; }
+		if (seq[1] == '2' && seq[2] == '0') // <esc>[200~ <esc>[201~ ( not <esc>[20~ = F9 )
+		{
+		    int last = inputByte(100);
+		    if (last != '0' && last != '1') { return '\x1b'; }
+		    if (inputByte(100) != '~') { return '\x1b'; }
+		    return last == '0' ? PASTE_START : PASTE_END;
+		}
 		if (seq[2] == '~')
 		{
 		    switch (seq[1])
@@ -270,7 +794,9 @@ int getCursorPosition(int *rows, int *cols)
 
     while (i < sizeof(buf) - 1)
     {
-	if(read(STDIN_FILENO, &buf[i], 1) != 1) { break; }
+	int c = inputByte(100);
+	if (c == -1) { break; }
+	buf[i] = c;
 	if (buf[i] == 'R') { break; }
 	i++;
     }
@@ -305,568 +831,4077 @@ int getWindowSize(int *rows, int *cols)
 }
 
 
-/********* Syntax highlight *********************************************/
-/************************************************************************/
-int is_separator(int c)
+/*************************************************************************/
+/********* Row memory ****************************************************/
+// class of a buffer of "n" bytes: steps of 16 bytes up to 256, then 4 steps for every power of 2
+// ( a buffer uses at most 25% more than asked )
+int slabClass(size_t n)
 {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];\"", c) != NULL;
-    // "strchr()" return a pointer to first occurrence of char in string, NULL if string does not contain the char 
+    if (n <= 256) { return n ? (n - 1) / 16 : 0; }
+
+    int p = 63 - __builtin_clzll(n - 1); // 2^p < n <= 2^(p+1)
+    return 16 + (p - 8) * 4 + (n - 1 - ((size_t)1 << p)) / ((size_t)1 << (p - 2));
 }
 
-void editorUpdateSyntax(erow *row)
+size_t slabSize(int c)
 {
-    row->hl = realloc(row->hl, row->rendersize);
-    memset(row->hl, HL_NORMAL, row->rendersize); 
-    // copy "HL_NORMAL" - in each "row->hl" bytes - from start to "row->size"
+    if (c < 16) { return (c + 1) * 16; }
+
+    int p = (c - 16) / 4 + 8;
+    return ((size_t)1 << p) + ((c - 16) % 4 + 1) * ((size_t)1 << (p - 2));
+}
 
-    if (E.syntax == NULL) { return; }
+void *rowAlloc(size_t n)
+{
+    if (n > KILO_SLAB_MAX)
+    {
+	void *p = malloc(n);
+	if (p == NULL) { die("malloc"); }
+	return p;
+    }
 
-    char **keywords = E.syntax->keywords;
+    struct rowHeap *h = &E.heap;
+    int c = slabClass(n);
+    void *p = h->freeList[c];
+    if (p) 
+    { 
+	memcpy(&h->freeList[c], p, sizeof(void *)); // next free buffer is stored in the buffer
+	return p; 
+    }
 
-    char *scs = E.syntax->single_line_comment_start;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
+    size_t size = slabSize(c);
+    if (h->left < size) // the rest of the chunk is left unused ( less than KILO_SLAB_MAX )
+    {
+	h->chunk = malloc(KILO_SLAB_CHUNK);
+	if (h->chunk == NULL) { die("malloc"); }
+	h->left = KILO_SLAB_CHUNK;
+    }
+    p = h->chunk;
+    h->chunk += size;
+    h->left -= size;
+    return p;
+}
 
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
+// "n" is the size the buffer was allocated with
+void rowFree(void *p, size_t n)
+{
+    if (p == NULL) { return; }
+    if (n > KILO_SLAB_MAX) 
+    { 
+	free(p); 
+	return; 
+    }
 
-    int prev_sep = 1;
-    int in_string = 0; // string begin
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+    int c = slabClass(n);
+    memcpy(p, &E.heap.freeList[c], sizeof(void *));
+    E.heap.freeList[c] = p;
+}
 
-    int i = 0;
-    while (i < row->rendersize)
+// from "old" to "n" bytes: in place while the size class is the same ( typing in a row )
+void *rowRealloc(void *p, size_t old, size_t n)
+{
+    if (p == NULL) { return rowAlloc(n); }
+    if (old <= KILO_SLAB_MAX && n <= KILO_SLAB_MAX && slabClass(old) == slabClass(n)) { return p; }
+    if (old > KILO_SLAB_MAX && n > KILO_SLAB_MAX)
     {
-	char c = row->render[i];
-	unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+	p = realloc(p, n);
+	if (p == NULL) { die("realloc"); }
+	return p;
+    }
 
-	if (scs_len && !in_string && !in_comment)
-	{
-	    if (!strncmp(&row->render[i], scs, scs_len))
-	    {
-		memset(&row->hl[i], HL_MLCOMMENT, row->rendersize - i);
-		break;
-	    }
-	}
+    void *q = rowAlloc(n);
+    memcpy(q, p, old < n ? old : n);
+    rowFree(p, old);
+    return q;
+}
 
-	// multiline comments
-	if (mcs_len && mce_len && !in_string)
-	{
-	    if (in_comment)
-	    {
-		row->hl[i] = HL_MLCOMMENT;
-		if (!strncmp(&row->render[i], mce, mce_len)) // comment is over
-		{
-		    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-		    i += mce_len;
-		    in_comment = 0;
-		    prev_sep = 1;
-		    continue;
-		}
-		else // comment continues
-		{
-		    i++;
-		    continue;
-		}
-	    }
-	    else if  (!strncmp(&row->render[i], mcs, mcs_len))
-	    {
-		memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-	        i += mcs_len;
-		in_comment = 1;    
-		continue;
-	    }
-	}
 
-	if (E.syntax->flags & HL_HIGHLIGHT_STRINGS)
-	{
-	    if (in_string)
-	    {
-		row->hl[i] = HL_STRING;
-		if (c == '\\' && i + 1 < row->rendersize) // also char after \ as string
-		{
-		    row->hl[i + 1] = HL_STRING;
-		    i += 2;
-		    continue;
-		}
-		if (c == in_string) { in_string = 0; }
-		i++;
-		prev_sep = 1;
-		continue;
-	    }
-	    else 
-	    {
-		if (c == '"' || c == '\'')
-		{
-		    in_string = c;
-		    row->hl[i] = HL_STRING;
-		    i++;
-		    continue;
-		}
-	    }
-	}
+/*************************************************************************/
+/********* Row storage ***************************************************/
+int blockCount(struct rowBlock *b)
+{
+    return b ? b->count : 0;
+}
 
-	if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) 
-	{
-	    if ( ( isdigit(c) && (prev_sep || prev_hl == HL_NUMBER) ) || 
-		(c == '.' && prev_hl == HL_NUMBER) )
-	    {
-		row->hl[i] = HL_NUMBER;
-		i++;
-		prev_sep = 0;
-		continue;
-	    }
-	}
+void blockPull(struct rowBlock *b)
+{
+    b->count = blockCount(b->left) + b->nrows + blockCount(b->right);
+    if (b->left) { b->left->parent = b; }
+    if (b->right) { b->right->parent = b; }
+}
 
-	if (prev_sep)
-	{
-	    int j;
-	    for (j = 0; keywords[j]; j++)
-	    {
-		int klen = strlen(keywords[j]);
-		int kw2 = keywords[j][klen - 1] == '|';
-		int kw3 = keywords[j][klen - 1] == '@';
-		int kw4 = keywords[j][klen - 1] == '#';
-		if (kw2 || kw3 || kw4) { klen--; }
-
-		if (!strncmp(&row->render[i], keywords[j], klen) && 
-		    is_separator(row->render[i + klen]))
-		{
-		    //memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-		    if (kw2) { memset(&row->hl[i], HL_KEYWORD2, klen); }
-		    else if (kw3) { memset(&row->hl[i], HL_KEYWORD3, klen); }
-		    else if (kw4) { memset(&row->hl[i], HL_KEYWORD4, klen); }
-		    else { memset(&row->hl[i], HL_KEYWORD1, klen); }
-
-		    i += klen;
-		    break;
-		}
-	    }
-	    if (keywords[j] != NULL)
-	    {
-		prev_sep = 0;
-		continue;
-	    }
-	}
+struct rowBlock *blockNewMapped(int first, int nrows)
+{
+    struct rowBlock *b = malloc(sizeof(struct rowBlock));
+    if (b == NULL) { die("malloc"); }
+
+    b->left = b->right = b->parent = NULL;
+    b->prio = rand();
+    b->count = nrows;
+    b->nrows = nrows;
+    b->mapFirst = first;
+    b->rows = NULL;
+    return b;
+}
 
-	prev_sep = is_separator(c);
-	i++;
-    }
+struct rowBlock *blockNew()
+{
+    struct rowBlock *b = blockNewMapped(0, 0);
+    b->rows = malloc(sizeof(erow) * KILO_BLOCK_ROWS);
+    if (b->rows == NULL) { die("malloc"); }
+    return b;
+}
 
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.numTextRows)
-	editorUpdateSyntax(&E.row[row->idx + 1]);
+void blockFree(struct rowBlock *b)
+{
+    free(b->rows);
+    free(b);
 }
 
-int editorSyntaxToColor(int hl)
+// join two trees, every row of "a" comes before the rows of "b"
+struct rowBlock *blockMerge(struct rowBlock *a, struct rowBlock *b)
 {
-    switch (hl) 
+    if (a == NULL) { return b; }
+    if (b == NULL) { return a; }
+
+    if (a->prio > b->prio)
     {
-	case HL_COMMENT:
-	case HL_MLCOMMENT: return 242;
-	case HL_KEYWORD1: return 211;
-	case HL_KEYWORD2: return 147; //111
-	case HL_KEYWORD3: return 180;
-	case HL_STRING: return 108;
-	case HL_NUMBER: 
-	case HL_KEYWORD4: return 218;
-	case HL_MATCH: return 197;
-	
-	default: return 37;
+	a->right = blockMerge(a->right, b);
+	blockPull(a);
+	return a;
     }
+    b->left = blockMerge(a, b->left);
+    blockPull(b);
+    return b;
 }
 
-void editorSelectSyntaxHighlight()
+// split the tree in the first "k" rows and the rest ( "k" must fall on a block boundary )
+void blockSplit(struct rowBlock *t, int k, struct rowBlock **l, struct rowBlock **r)
 {
-    E.syntax = NULL;
-    if (E.filename == NULL) { return; }
-
+    if (t == NULL) 
+    { 
+	*l = *r = NULL; 
+	return; 
+    }
+
+    int lc = blockCount(t->left);
+    if (k <= lc)
+    {
+	blockSplit(t->left, k, l, &t->left);
+	*r = t;
+    }
+    else
+    {
+	blockSplit(t->right, k - lc - t->nrows, &t->right, r);
+	*l = t;
+    }
+    blockPull(t);
+}
+
+// index of the first row of the block (walk up to the root)
+int blockIndex(struct rowBlock *b)
+{
+    int at = blockCount(b->left);
+    while (b->parent)
+    {
+	if (b == b->parent->right)
+	    at += blockCount(b->parent->left) + b->parent->nrows;
+	b = b->parent;
+    }
+    return at;
+}
+
+// block containing row "at" and the offset of the row inside it
+struct rowBlock *blockFind(int at, int *off)
+{
+    struct rowBlock *b = E.rowTree;
+    while (b)
+    {
+	int lc = blockCount(b->left);
+	if (at < lc) 
+	{ 
+	    b = b->left; 
+	}
+	else if (at < lc + b->nrows) 
+	{ 
+	    *off = at - lc; 
+	    return b; 
+	}
+	else
+	{
+	    at -= lc + b->nrows;
+	    b = b->right;
+	}
+    }
+    return NULL;
+}
+
+struct rowBlock *blockNext(struct rowBlock *b)
+{
+    if (b->right)
+    {
+	b = b->right;
+	while (b->left) { b = b->left; }
+	return b;
+    }
+    while (b->parent && b == b->parent->right) { b = b->parent; }
+    return b->parent;
+}
+
+struct rowBlock *blockPrev(struct rowBlock *b)
+{
+    if (b->left)
+    {
+	b = b->left;
+	while (b->right) { b = b->right; }
+	return b;
+    }
+    while (b->parent && b == b->parent->left) { b = b->parent; }
+    return b->parent;
+}
+
+// rows added/removed from a block: fix the counts up to the root
+void blockAdjust(struct rowBlock *b, int delta)
+{
+    for (; b; b = b->parent) { b->count += delta; }
+}
+
+// put block "nb" in the tree so that its first row is at index "at"
+void blockInsert(struct rowBlock *nb, int at)
+{
+    struct rowBlock *l, *r;
+
+    blockSplit(E.rowTree, at, &l, &r);
+    blockPull(nb);
+    E.rowTree = blockMerge(blockMerge(l, nb), r);
+    E.rowTree->parent = NULL;
+}
+
+void blockRemove(struct rowBlock *b)
+{
+    struct rowBlock *l, *m, *r;
+
+    blockSplit(E.rowTree, blockIndex(b), &l, &r);
+    blockSplit(r, b->nrows, &m, &r);
+    E.rowTree = blockMerge(l, r);
+    if (E.rowTree) { E.rowTree->parent = NULL; }
+    blockFree(m);
+}
+
+// line "n" of the mapped file without the line terminators
+char *editorMappedLine(int n, size_t *len)
+{
+    char *s = &E.map[E.lineIndex[n]];
+    size_t l = E.lineIndex[n + 1] - E.lineIndex[n] - 1; // - '\n'
+    while (l > 0 && s[l - 1] == '\r') { l--; }
+    *len = l;
+    return s;
+}
+
+// load the rows around "*off" of a mapped block: the block becomes a block of 
+// KILO_BLOCK_ROWS real rows, the lines before and after it stay mapped in new blocks
+struct rowBlock *blockLoad(struct rowBlock *b, int *off)
+{
+    struct rowBlock *l, *m, *r;
+    int start = blockIndex(b);
+    int first = (*off / KILO_BLOCK_ROWS) * KILO_BLOCK_ROWS;
+    int n = b->nrows - first;
+    if (n > KILO_BLOCK_ROWS) { n = KILO_BLOCK_ROWS; }
+
+    blockSplit(E.rowTree, start, &l, &r);
+    blockSplit(r, b->nrows, &m, &r); // m == b
+
+    if (first > 0) 
+	l = blockMerge(l, blockNewMapped(b->mapFirst, first));
+    if (first + n < b->nrows)
+	r = blockMerge(blockNewMapped(b->mapFirst + first + n, b->nrows - first - n), r);
+
+    b->mapFirst += first;
+    b->nrows = n;
+    b->rows = malloc(sizeof(erow) * KILO_BLOCK_ROWS);
+    if (b->rows == NULL) { die("malloc"); }
+    blockPull(b);
+    E.rowTree = blockMerge(blockMerge(l, b), r);
+    E.rowTree->parent = NULL;
+
+    for (int j = 0; j < n; j++)
+    {
+	size_t len;
+	char *s = editorMappedLine(b->mapFirst + j, &len);
+	b->rows[j].blk = b;
+	editorInitRow(&b->rows[j], s, len);
+    }
+    for (int j = 0; j < n; j++) { editorRenderRow(&b->rows[j]); }
+
+    *off -= first;
+    return b;
+}
+
+// like blockFind() but the rows of a mapped block are loaded
+struct rowBlock *blockFindRow(int at, int *off)
+{
+    struct rowBlock *b = blockFind(at, off);
+    if (b && b->rows == NULL) { b = blockLoad(b, off); }
+    return b;
+}
+
+struct rowBlock *blockFirst()
+{
+    struct rowBlock *b = E.rowTree;
+    while (b && b->left) { b = b->left; }
+    return b;
+}
+
+erow *editorRowAt(int at)
+{
+    if (at < 0 || at >= E.numTextRows) { return NULL; }
+
+    int off;
+    struct rowBlock *b = blockFindRow(at, &off);
+    return &b->rows[off];
+}
+
+// chars of a line, without turning mapped lines into rows
+char *editorLineChars(int at, size_t *len)
+{
+    int off;
+    struct rowBlock *b = blockFind(at, &off);
+    if (b->rows)
+    {
+	*len = b->rows[off].size;
+	return b->rows[off].chars;
+    }
+    return editorMappedLine(b->mapFirst + off, len);
+}
+
+int editorRowIndex(erow *row)
+{
+    return blockIndex(row->blk) + (row - row->blk->rows);
+}
+
+// next/previous row, NULL at the end of file or when the lines there are still mapped
+erow *editorNextRow(erow *row)
+{
+    struct rowBlock *b = row->blk;
+    if (row + 1 < &b->rows[b->nrows]) { return row + 1; }
+
+    b = blockNext(b);
+    return (b && b->rows) ? &b->rows[0] : NULL;
+}
+
+erow *editorPrevRow(erow *row)
+{
+    struct rowBlock *b = row->blk;
+    if (row > &b->rows[0]) { return row - 1; }
+
+    b = blockPrev(b);
+    return (b && b->rows) ? &b->rows[b->nrows - 1] : NULL;
+}
+
+// make room for a new row at index "at", the returned row is counted but not initialized
+erow *editorOpenRow(int at)
+{
+    struct rowBlock *b;
+    int off;
+
+    if (E.rowTree == NULL)
+    {
+	b = E.rowTree = blockNew();
+	off = 0;
+    }
+    else if (at == E.numTextRows)
+    {
+	b = blockFindRow(at - 1, &off);
+	off++;
+    }
+    else
+    {
+	b = blockFindRow(at, &off);
+    }
+
+    if (b->nrows == KILO_BLOCK_ROWS) // full block: split it
+    {
+	int start = blockIndex(b);
+	struct rowBlock *nb = blockNew();
+
+	if (off == KILO_BLOCK_ROWS) // appending (when loading a file): start an empty block
+	{
+	    blockInsert(nb, start + b->nrows);
+	    b = nb;
+	    off = 0;
+	}
+	else // move the upper half to the new block
+	{
+	    int half = KILO_BLOCK_ROWS / 2;
+	    nb->nrows = KILO_BLOCK_ROWS - half;
+	    memcpy(nb->rows, &b->rows[half], sizeof(erow) * nb->nrows);
+	    for (int j = 0; j < nb->nrows; j++) { nb->rows[j].blk = nb; }
+
+	    b->nrows = half;
+	    blockAdjust(b, -nb->nrows);
+	    blockInsert(nb, start + half);
+	    if (off >= half)
+	    {
+		b = nb;
+		off -= half;
+	    }
+	}
+    }
+
+    memmove(&b->rows[off + 1], &b->rows[off], sizeof(erow) * (b->nrows - off));
+    b->nrows++;
+    blockAdjust(b, 1);
+    b->rows[off].blk = b;
+    E.numTextRows++;
+
+    return &b->rows[off];
+}
+
+// drop the row at index "at" from the tree (its buffers must be already freed)
+void editorCloseRow(int at)
+{
+    int off;
+    struct rowBlock *b = blockFindRow(at, &off);
+
+    if (b->nrows == 1)
+    {
+	blockRemove(b);
+    }
+    else
+    {
+	memmove(&b->rows[off], &b->rows[off + 1], sizeof(erow) * (b->nrows - off - 1));
+	b->nrows--;
+	blockAdjust(b, -1);
+    }
+    E.numTextRows--;
+}
+
+
+/********* Syntax highlight *********************************************/
+/************************************************************************/
+int is_separator(int c)
+{
+    unsigned char u = c;
+    if (E.syntax) { return (E.syntax->sep[u >> 3] >> (u & 7)) & 1; }
+    return isspace(c) || c == '\0' || strchr(KILO_SEPARATORS, c) != NULL;
+    // "strchr()" return a pointer to first occurrence of char in string, NULL if string does not contain the char 
+}
+
+// bitmap of the spaces, '\0' and the chars of "chars"
+void editorSeparatorsCompile(unsigned char *sep, const char *chars)
+{
+    memset(sep, 0, 32);
+    for (int c = 0; c < 256; c++)
+    {
+	if (isspace(c) || c == '\0' || (c > 0 && strchr(chars, c))) { sep[c >> 3] |= 1 << (c & 7); }
+    }
+}
+
+// trie of "n" keywords of class "classes[j]" ( HL_KEYWORD1..4 )
+struct kwTrie *kwTrieBuild(char **keywords, const unsigned char *classes, int n)
+{
+    struct kwTrie *t = calloc(1, sizeof(struct kwTrie));
+    if (t == NULL) { die("calloc"); }
+    int maxnodes = 1;
+    int j, k;
+
+    t->nalpha = 1;
+    for (j = 0; j < n; j++)
+    {
+	for (k = 0; keywords[j][k]; k++)
+	{
+	    unsigned char c = keywords[j][k];
+	    if (t->alpha[c] == 0) { t->alpha[c] = t->nalpha++; }
+	}
+	maxnodes += k;
+    }
+
+    t->next = calloc(maxnodes * t->nalpha, sizeof(int));
+    t->hlClass = calloc(maxnodes, 1);
+    t->order = calloc(maxnodes, sizeof(int));
+    if (t->next == NULL || t->hlClass == NULL || t->order == NULL) { die("calloc"); }
+    t->nnodes = 1;
+
+    for (j = 0; j < n; j++)
+    {
+	int klen = strlen(keywords[j]);
+	int kclass = classes[j];
+
+	if (klen > t->maxLen) { t->maxLen = klen; }
+	int node = 0;
+	for (k = 0; k < klen; k++)
+	{
+	    int *edge = &t->next[node * t->nalpha + t->alpha[(unsigned char)keywords[j][k]]];
+	    if (*edge == 0) { *edge = t->nnodes++; }
+	    node = *edge;
+	}
+	if (t->hlClass[node] == 0) // same keyword twice: the first one counts
+	{
+	    t->hlClass[node] = kclass;
+	    t->order[node] = j;
+	}
+    }
+    return t;
+}
+
+// compile the keywords of a built-in syntax. The class is the char at the end of the keyword:
+// "|" = HL_KEYWORD2, "@" = HL_KEYWORD3, "#" = HL_KEYWORD4, none = HL_KEYWORD1
+void editorKeywordCompile(struct editorSyntax *syntax)
+{
+    if (syntax->trie) { return; }
+
+    int n = 0;
+    while (syntax->keywords[n]) { n++; }
+    char **words = malloc((n + 1) * sizeof(char *));
+    unsigned char *classes = calloc(n + 1, 1);
+    if (words == NULL || classes == NULL) { die("malloc"); }
+
+    for (int j = 0; j < n; j++)
+    {
+	int klen = strlen(syntax->keywords[j]);
+	classes[j] = HL_KEYWORD1;
+	switch (syntax->keywords[j][klen - 1])
+	{
+	    case '|': classes[j] = HL_KEYWORD2; klen--; break;
+	    case '@': classes[j] = HL_KEYWORD3; klen--; break;
+	    case '#': classes[j] = HL_KEYWORD4; klen--; break;
+	}
+	words[j] = strndup(syntax->keywords[j], klen);
+	if (words[j] == NULL) { die("strndup"); }
+    }
+
+    syntax->trie = kwTrieBuild(words, classes, n);
+    editorSeparatorsCompile(syntax->sep, KILO_SEPARATORS);
+    for (int j = 0; j < n; j++) { free(words[j]); }
+    free(words);
+    free(classes);
+}
+
+// keyword at the start of "s" followed by a separator: its class and length in "*klen", or 0.
+// When more keywords match ( "<" and "<=" ) the first in the list wins
+int editorKeywordMatch(struct kwTrie *t, const char *s, int len, int *klen)
+{
+    int node = 0;
+    int kclass = 0;
+    int order = 0;
+
+    for (int k = 0; k < len; k++)
+    {
+	int a = t->alpha[(unsigned char)s[k]];
+	if (a == 0) { break; }
+	node = t->next[node * t->nalpha + a];
+	if (node == 0) { break; }
+
+	if (t->hlClass[node] && (k + 1 == len || is_separator(s[k + 1])) && 
+	    (kclass == 0 || t->order[node] < order))
+	{
+	    kclass = t->hlClass[node];
+	    order = t->order[node];
+	    *klen = k + 1;
+	}
+    }
+    return kclass;
+}
+
+// highlight the chars [from, to) of a line of "len" chars, starting with the state "*st" ( "from" is
+// the start of the line or a place where the highlighter can start again, see editorHighlightClean() ).
+// hl[0] is the cell at "from": a keyword or a delimiter crossing "to" is written past it, less than 
+// the longest keyword + 4 cells. Returns where it stopped ( >= to ), with the state there in "*st".
+// With "hl" NULL only the state is followed ( strings and comments, no keywords/numbers )
+int editorHighlightRange(const char *s, int from, int to, int len, unsigned char *hl, struct hlState *st)
+{
+    if (hl) { memset(hl, HL_NORMAL, to - from); }
+    // copy "HL_NORMAL" - in each "hl" bytes - from start to "to"
+
+    if (E.syntax == NULL) { return to; }
+
+    char *scs = E.syntax->single_line_comment_start;
+    char *mcs = E.syntax->multiline_comment_start;
+    char *mce = E.syntax->multiline_comment_end;
+
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+
+    int prev_sep = 1;
+    int in_string = st->in_string; // string begin
+    int in_comment = st->in_comment;
+
+    int i = from;
+    while (i < to)
+    {
+	char c = s[i];
+	unsigned char *h = hl ? &hl[i - from] : NULL; // cell of s[i]
+	unsigned char prev_hl = (hl && i > from) ? h[-1] : HL_NORMAL;
+
+	if (scs_len && !in_string && !in_comment)
+	{
+	    if (i + scs_len <= len && !memcmp(&s[i], scs, scs_len))
+	    {
+		if (hl) { memset(h, HL_MLCOMMENT, to - i); }
+		i = len;
+		break;
+	    }
+	}
+
+	// multiline comments
+	if (mcs_len && mce_len && !in_string)
+	{
+	    if (in_comment)
+	    {
+		if (hl) { h[0] = HL_MLCOMMENT; }
+		if (i + mce_len <= len && !memcmp(&s[i], mce, mce_len)) // comment is over
+		{
+		    if (hl) { memset(h, HL_MLCOMMENT, mce_len); }
+		    i += mce_len;
+		    in_comment = 0;
+		    prev_sep = 1;
+		    continue;
+		}
+		else // comment continues
+		{
+		    i++;
+		    continue;
+		}
+	    }
+	    else if (i + mcs_len <= len && !memcmp(&s[i], mcs, mcs_len))
+	    {
+		if (hl) { memset(h, HL_MLCOMMENT, mcs_len); }
+	        i += mcs_len;
+		in_comment = 1;    
+		continue;
+	    }
+	}
+
+	if (E.syntax->flags & HL_HIGHLIGHT_STRINGS)
+	{
+	    if (in_string)
+	    {
+		if (hl) { h[0] = HL_STRING; }
+		if (c == '\\' && i + 1 < len) // also char after \ as string
+		{
+		    if (hl) { h[1] = HL_STRING; }
+		    i += 2;
+		    continue;
+		}
+		if (c == '\\') // "\" at the end: the string goes on in the next row
+		{
+		    i++;
+		    st->in_string = in_string;
+		    st->in_comment = in_comment;
+		    return i;
+		}
+		if (c == in_string) { in_string = 0; }
+		i++;
+		prev_sep = 1;
+		continue;
+	    }
+	    else 
+	    {
+		if (c == '"' || c == '\'')
+		{
+		    in_string = c;
+		    if (hl) { h[0] = HL_STRING; }
+		    i++;
+		    continue;
+		}
+	    }
+	}
+
+	if (hl == NULL) // numbers and keywords can't open or close comments
+	{
+	    i++;
+	    continue;
+	}
+
+	if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) 
+	{
+	    if ( ( isdigit(c) && (prev_sep || prev_hl == HL_NUMBER) ) || 
+		(c == '.' && prev_hl == HL_NUMBER) )
+	    {
+		h[0] = HL_NUMBER;
+		i++;
+		prev_sep = 0;
+		continue;
+	    }
+	}
+
+	if (prev_sep)
+	{
+	    int klen;
+	    int kclass = editorKeywordMatch(E.syntax->trie, &s[i], len - i, &klen);
+	    if (kclass)
+	    {
+		memset(h, kclass, klen);
+		i += klen;
+		prev_sep = 0;
+		continue;
+	    }
+	}
+
+	prev_sep = is_separator(c);
+	i++;
+    }
+
+    st->in_comment = in_comment;
+    st->in_string = (i < len) ? in_string : 0; // a string not continued ends with the row
+    return i;
+}
+
+// highlight a line starting with the state "st", return the state at its end
+struct hlState editorHighlightLine(const char *s, int len, unsigned char *hl, struct hlState st)
+{
+    editorHighlightRange(s, 0, len, len, hl, &st);
+    return st;
+}
+
+int hlStateEq(struct hlState a, struct hlState b)
+{
+    return a.in_comment == b.in_comment && a.in_string == b.in_string;
+}
+
+// hl of every cell -> runs of the row ( the HL_NORMAL cells at the end are left out )
+void editorRowSetRuns(erow *row, const unsigned char *hl, int len)
+{
+    while (len > 0 && hl[len - 1] == HL_NORMAL) { len--; }
+
+    int n = 0;
+    int i;
+    for (i = 0; i < len; n++)
+    {
+	int j = i + 1;
+	while (j < len && hl[j] == hl[i] && j - i < 255) { j++; }
+	i = j;
+    }
+
+    if (n == 0) 
+    { 
+	rowFree(row->hl, row->hlRuns * 2); 
+	row->hl = NULL; 
+    }
+    else
+    {
+	row->hl = rowRealloc(row->hl, row->hlRuns * 2, n * 2);
+    }
+    row->hlRuns = n;
+
+    unsigned char *run = row->hl;
+    for (i = 0; i < len; run += 2)
+    {
+	int j = i + 1;
+	while (j < len && hl[j] == hl[i] && j - i < 255) { j++; }
+	run[0] = j - i;
+	run[1] = hl[i];
+	i = j;
+    }
+}
+
+// scratch memory of the highlighter, at least "n" bytes
+unsigned char *editorHlScratch(int n)
+{
+    if (n > E.hlLineCap)
+    {
+	E.hlLineCap = n * 2;
+	E.hlLine = realloc(E.hlLine, E.hlLineCap);
+	if (E.hlLine == NULL) { die("realloc"); }
+    }
+    return E.hlLine;
+}
+
+// long rows: follow the highlighter state ( strings and comments only ) up to "cx" at least, with 
+// a mark every KILO_LONG_MARK chars where it can start again. At the row end its end state is known
+void editorLongScan(erow *row, int cx)
+{
+    struct longRow *w = row->wide;
+    while (w->scanned < cx && w->scanned < row->size)
+    {
+	int to = w->marks[w->nmarks - 1].at + KILO_LONG_MARK;
+	if (to > row->size) { to = row->size; }
+	int i = w->scanned;
+	if (i < to) { i = editorHighlightRange(row->chars, i, to, row->size, NULL, &w->st); }
+	while (i < row->size && !w->st.in_comment && !w->st.in_string && !editorHighlightRestart(row->chars[i - 1]))
+	    i = editorHighlightRange(row->chars, i, i + 1, row->size, NULL, &w->st);
+
+	if (i < row->size)
+	{
+	    if (w->nmarks == w->markCap)
+	    {
+		w->markCap = w->markCap ? w->markCap * 2 : 64;
+		w->marks = realloc(w->marks, w->markCap * sizeof(struct hlMark));
+		if (w->marks == NULL) { die("realloc"); }
+	    }
+	    w->marks[w->nmarks].at = i;
+	    w->marks[w->nmarks++].st = w->st;
+	}
+	else
+	{
+	    row->hl_out = w->st;
+	}
+	w->scanned = i;
+    }
+}
+
+// state at the end of a highlighted row ( a long row is scanned to the end for it )
+struct hlState editorRowEndState(erow *row)
+{
+    if (row->wide && row->wide->scanned < row->size) { editorLongScan(row, row->size); }
+    return row->hl_out;
+}
+
+// render and runs of a long row for the cells [col, col + len) and KILO_LONG_MARGIN cells around 
+// them: highlighted from the last mark before them ( no runs if the row isn't highlighted )
+struct longRow *editorLongWindow(erow *row, int col, int len)
+{
+    struct longRow *w = row->wide;
+    if (w->winValid && w->winColored == row->hl_valid && 
+	col >= w->winFrom && col + len <= w->winFrom + w->winLen) { return w; }
+
+    int from = col > KILO_LONG_MARGIN ? col - KILO_LONG_MARGIN : 0;
+    int to = col + len + KILO_LONG_MARGIN;
+    if (to > row->rendersize) { to = row->rendersize; }
+    int cx = editorRowRxToCx(row, from); // char of the first cell
+    int cxEnd = editorRowRxToCx(row, to - 1) + 1;
+
+    int markAt = cx;
+    unsigned char *hl = NULL;
+    if (row->hl_valid)
+    {
+	editorLongScan(row, cx);
+	int lo = 0, hi = w->nmarks; // last mark before cx
+	while (hi - lo > 1)
+	{
+	    int mid = (lo + hi) / 2;
+	    if (w->marks[mid].at <= cx) { lo = mid; }
+	    else { hi = mid; }
+	}
+	struct hlMark *m = &w->marks[lo];
+	struct hlState st = m->st;
+	int look = (E.syntax && E.syntax->trie ? E.syntax->trie->maxLen : 0) + 4;
+	markAt = m->at;
+	hl = editorHlScratch(cxEnd - markAt + look);
+	editorHighlightRange(row->chars, markAt, cxEnd, row->size, hl, &st);
+    }
+
+    if (to - from > w->winCap)
+    {
+	w->winCap = to - from;
+	w->winText = realloc(w->winText, w->winCap);
+	w->winRuns = realloc(w->winRuns, w->winCap * 2);
+	if (w->winText == NULL || w->winRuns == NULL) { die("realloc"); }
+    }
+
+    int rx = editorRowCxToRx(row, cx);
+    w->winRunsLen = 0;
+    for (int j = cx; j < cxEnd; j++)
+    {
+	char c = row->chars[j];
+	int width = (c == '\t') ? KILO_TAB_STOP - rx % KILO_TAB_STOP : 1;
+	for (int k = 0; k < width; k++, rx++)
+	{
+	    if (rx < from || rx >= to) { continue; }
+	    w->winText[rx - from] = (c == '\t') ? ' ' : c;
+	    if (hl) { hlRunPush(w->winRuns, &w->winRunsLen, 1, hl[j - markAt]); }
+	}
+    }
+    w->winFrom = from;
+    w->winLen = to - from;
+    w->winValid = 1;
+    w->winColored = row->hl_valid;
+    return w;
+}
+
+// highlight a row that starts with the state "st"
+void editorHighlightRow(erow *row, struct hlState st)
+{
+    row->hl_in = st;
+    row->hl_valid = 1;
+
+    struct longRow *w = row->wide;
+    if (w) // only the start state now: scanned when shown
+    {
+	if (w->markCap == 0)
+	{
+	    w->markCap = 64;
+	    w->marks = malloc(w->markCap * sizeof(struct hlMark));
+	    if (w->marks == NULL) { die("malloc"); }
+	}
+	w->marks[0].at = 0;
+	w->marks[0].st = st;
+	w->nmarks = 1;
+	w->scanned = 0;
+	w->st = w->marks[0].st;
+	w->winValid = 0;
+	return;
+    }
+
+    unsigned char *hl = editorHlScratch(row->rendersize);
+    row->hl_out = editorHighlightLine(editorRowRender(row), row->rendersize, hl, st);
+    editorRowSetRuns(row, hl, row->rendersize);
+}
+
+// state at the end of row "at": from the row itself if highlighted with the same 
+// starting state, else scanning its text ( without loading mapped lines )
+struct hlState editorSyntaxRowEnd(struct rowBlock *b, int off, struct hlState st)
+{
+    if (b->rows == NULL)
+    {
+	size_t len;
+	char *s = editorMappedLine(b->mapFirst + off, &len);
+	return editorHighlightLine(s, len, NULL, st);
+    }
+
+    erow *row = &b->rows[off];
+    if (row->hl_valid && hlStateEq(row->hl_in, st)) { return editorRowEndState(row); }
+    return editorHighlightLine(row->chars, row->size, NULL, st); // tabs don't change the state
+}
+
+// the frontier reached row "at": keep its starting state every KILO_HL_CHECKPOINT rows
+void editorSyntaxCheckpoint(int at, struct hlState st)
+{
+    if (at % KILO_HL_CHECKPOINT != 0) { return; }
+
+    int c = at / KILO_HL_CHECKPOINT;
+    if (c >= E.hlCheckpointCap)
+    {
+	E.hlCheckpointCap = E.hlCheckpointCap ? E.hlCheckpointCap * 2 : 1024;
+	E.hlCheckpoint = realloc(E.hlCheckpoint, E.hlCheckpointCap * sizeof(struct hlState));
+	if (E.hlCheckpoint == NULL) { die("realloc"); }
+    }
+    E.hlCheckpoint[c] = st;
+}
+
+// follow the highlighter state from row "from" to row "to" ( saving the checkpoints on the way )
+struct hlState editorSyntaxScan(int from, int to, struct hlState st, int checkpoints)
+{
+    int off;
+    struct rowBlock *b = blockFind(from, &off);
+
+    for (; b && from < to; b = blockNext(b), off = 0)
+    {
+	for (; off < b->nrows && from < to; off++, from++)
+	{
+	    if (checkpoints) { editorSyntaxCheckpoint(from, st); }
+	    st = editorSyntaxRowEnd(b, off, st);
+	}
+    }
+    return st;
+}
+
+// worker thread: the state scan of the snapshot, with the checkpoints on the way
+void *editorSyntaxThread(void *arg)
+{
+    struct hlJob *job = arg;
+    struct hlState st = job->st;
+    int at = job->from;
+    int first = job->from / KILO_HL_CHECKPOINT;
+
+    int cancel = 0;
+    for (int n = 0; n < job->nsegs && !cancel; n++)
+    {
+	struct saveSeg *seg = &job->segs[n];
+	for (int j = 0; j < seg->nrows && !cancel; j++, at++)
+	{
+	    if (at % KILO_HL_CHECKPOINT == 0) // the UI waits for the cancel at most this many rows
+	    { 
+		job->checkpoints[at / KILO_HL_CHECKPOINT - first] = st; 
+		cancel = __atomic_load_n(&job->cancel, __ATOMIC_RELAXED);
+	    }
+
+	    size_t len;
+	    char *s;
+	    if (seg->lines) 
+	    { 
+		s = seg->lines[j].iov_base; 
+		len = seg->lines[j].iov_len; 
+	    }
+	    else { s = editorMappedLine(seg->mapFirst + j, &len); }
+	    st = editorHighlightLine(s, len, NULL, st);
+	}
+    }
+
+    job->st = st;
+    __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+    write(job->wake[1], "h", 1);
+    return NULL;
+}
+
+void editorSyntaxJobStop()
+{
+    struct hlJob *job = E.hlJob;
+    if (job == NULL) { return; }
+
+    __atomic_store_n(&job->cancel, 1, __ATOMIC_RELAXED);
+    if (job->threaded) { pthread_join(job->thread, NULL); }
+    for (int n = 0; n < job->nsegs; n++) { free(job->segs[n].lines); }
+    free(job->segs);
+    free(job->checkpoints);
+    close(job->wake[0]);
+    close(job->wake[1]);
+    free(job);
+    E.hlJob = NULL;
+    editorKeptFree();
+}
+
+// the screen is at row "at", too far from the frontier to scan on the UI thread: the worker follows 
+// the state up to it on a snapshot of the rows. Returns 0 if the state is known already ( no thread )
+int editorSyntaxJobStart(int at)
+{
+    struct hlJob *job = calloc(1, sizeof(struct hlJob));
+    if (job == NULL) { die("calloc"); }
+    if (pipe(job->wake) == -1)
+    {
+	free(job);
+	return 0;
+    }
+    fcntl(job->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(job->wake[1], F_SETFL, O_NONBLOCK);
+
+    job->from = E.hlFrontier;
+    job->to = at;
+    job->st = E.hlState;
+    job->checkpoints = malloc(((at - 1) / KILO_HL_CHECKPOINT - job->from / KILO_HL_CHECKPOINT + 1) * sizeof(struct hlState));
+    if (job->checkpoints == NULL) { die("malloc"); }
+    job->nsegs = editorSnapshot(job->from, at, &job->segs);
+    job->gen = E.snapGen;
+    E.hlJob = job;
+
+    job->threaded = pthread_create(&job->thread, NULL, editorSyntaxThread, job) == 0;
+    if (!job->threaded)
+    {
+	editorSyntaxThread(job);
+	editorSyntaxCheck();
+	return 0;
+    }
+    return 1;
+}
+
+// called by the main thread when the worker wakes it up: the frontier jumps to the end of its scan
+void editorSyntaxCheck()
+{
+    struct hlJob *job = E.hlJob;
+    E.hlEvent = 0;
+    if (job == NULL) { return; }
+
+    char drain[64];
+    while (read(job->wake[0], drain, sizeof(drain)) > 0) {}
+    if (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) { return; }
+
+    int first = job->from / KILO_HL_CHECKPOINT;
+    for (int at = first * KILO_HL_CHECKPOINT; at < job->to; at += KILO_HL_CHECKPOINT)
+    {
+	if (at >= job->from) { editorSyntaxCheckpoint(at, job->checkpoints[at / KILO_HL_CHECKPOINT - first]); }
+    }
+    E.hlFrontier = job->to;
+    E.hlState = job->st;
+    editorSyntaxJobStop();
+}
+
+// row "at" changed ( or rows were added/removed there ): a scan reading it is stale
+void editorSyntaxJobStale(int at)
+{
+    if (E.hlJob && at < E.hlJob->to) { editorSyntaxJobStop(); }
+}
+
+// the state at the start of row "at" can be known now on the UI thread. A worker scans from the
+// frontier ( it doesn't move while one runs ) to its target: the rows just past the frontier are
+// scanned here anyway ( the worker is stopped ), the others wait for it ( past its target, for the next one )
+int editorSyntaxReady(int at)
+{
+    if (E.syntax == NULL || at <= E.hlFrontier) { return 1; }
+    if (E.hlJob && at > E.hlJob->to) { return 0; }
+    return at - E.hlFrontier <= KILO_HL_SYNC;
+}
+
+// highlighter state at the start of row "at". The rows before E.hlFrontier are known ( with a
+// checkpoint every KILO_HL_CHECKPOINT rows ), after it the frontier is moved forward
+struct hlState editorSyntaxState(int at)
+{
+    if (E.syntax == NULL) { return (struct hlState){ 0, 0 }; }
+
+    if (at >= E.hlFrontier)
+    {
+	if (at > E.hlFrontier) { editorSyntaxJobStop(); }
+	E.hlState = editorSyntaxScan(E.hlFrontier, at, E.hlState, 1);
+	E.hlFrontier = at;
+	return E.hlState;
+    }
+
+    int c = at / KILO_HL_CHECKPOINT;
+    return editorSyntaxScan(c * KILO_HL_CHECKPOINT, at, E.hlCheckpoint[c], 0);
+}
+
+// row "at" changed (or rows were added/removed there): states after it are not known anymore
+void editorSyntaxInvalidate(int at)
+{
+    editorSyntaxJobStale(at);
+    if (at >= E.hlFrontier) { return; }
+
+    int c = at / KILO_HL_CHECKPOINT;
+    E.hlFrontier = c * KILO_HL_CHECKPOINT;
+    E.hlState = E.hlCheckpoint[c];
+}
+
+// make sure row "at" is highlighted
+void editorSyntaxRow(int at)
+{
+    erow *row = editorRowAt(at);
+    if (row == NULL) { return; }
+
+    struct hlState st = editorSyntaxState(at);
+    if (!row->hl_valid || !hlStateEq(row->hl_in, st))
+	editorHighlightRow(row, st);
+}
+
+// highlight the rows on screen ( plus a few more ), the rows never shown are never highlighted.
+// Far from the frontier they are shown as they are until the worker thread gets there
+void editorSyntaxViewport()
+{
+    int at = E.rowOffset;
+    int last = E.rowOffset + E.screenRows + KILO_HL_LOOKAHEAD;
+    if (last > E.numTextRows) { last = E.numTextRows; }
+    if (at >= last) { return; }
+
+    if (!editorSyntaxReady(at))
+    {
+	if (E.hlJob || editorSyntaxJobStart(at)) { return; }
+    }
+    struct hlState st = editorSyntaxState(at);
+    for (; at < last; at++)
+    {
+	erow *row = editorRowAt(at);
+	if (!row->hl_valid || !hlStateEq(row->hl_in, st))
+	    editorHighlightRow(row, st);
+	if (row->wide && at + 1 == last) { break; } // its end state isn't needed ( not scanned )
+
+	if (at == E.hlFrontier && E.syntax) // the frontier follows the screen
+	{
+	    editorSyntaxJobStop();
+	    editorSyntaxCheckpoint(at, st);
+	    E.hlFrontier = at + 1;
+	    E.hlState = editorRowEndState(row);
+	}
+	st = editorRowEndState(row);
+    }
+}
+
+// a row changed while editing: highlight it again, from the state at its start ( scanned from 
+// the checkpoint before it ), and follow the state in the next rows until one ends the same as 
+// before. At most the rows until the end of the screen are highlighted, past it the rows are 
+// left stale ( the frontier goes back to them )
+void editorUpdateSyntax(erow *row)
+{
+    int at = editorRowIndex(row);
+    editorSyntaxJobStale(at);
+    if (!editorSyntaxReady(at)) // highlighted when the worker gets there
+    {
+	row->hl_valid = 0;
+	return;
+    }
+    struct hlState st = editorSyntaxState(at);
+    int last = E.rowOffset + E.screenRows;
+
+    do
+    {
+	// hl_out is right ( a long row may not be scanned to its end )
+	int known = row->hl_valid && hlStateEq(row->hl_in, st) && !row->wide;
+	struct hlState was = row->hl_out;
+
+	if (at < E.hlFrontier) { editorSyntaxCheckpoint(at, st); }
+	if (at == E.hlFrontier) { E.hlState = st; }
+
+	editorHighlightRow(row, st);
+	st = editorRowEndState(row);
+	if (known && hlStateEq(was, st)) { return; } // the next rows didn't change
+
+	row = editorNextRow(row);
+	at++;
+    } while (row && at < last);
+
+    // the state at the start of row "at" is known, after it is not
+    if (at < E.hlFrontier)
+    {
+	E.hlFrontier = at;
+	E.hlState = st;
+    }
+}
+
+// hl of the cells [from, to) of the row, from its runs
+void editorRowCells(erow *row, int from, int to, unsigned char *hl)
+{
+    memset(hl, HL_NORMAL, to - from);
+
+    int at = 0;
+    unsigned char *run = row->hl;
+    unsigned char *end = row->hl + row->hlRuns * 2;
+    for (; run < end && at < to; at += run[0], run += 2)
+    {
+	int a = at > from ? at : from;
+	int b = at + run[0] < to ? at + run[0] : to;
+	if (a < b) { memset(&hl[a - from], run[1], b - a); }
+    }
+}
+
+// "len" cells of "hl" after the runs ( joined to the last run when it's the same )
+void hlRunPush(unsigned char *runs, int *n, int len, int hl)
+{
+    while (len > 0)
+    {
+	unsigned char *last = *n ? &runs[(*n - 1) * 2] : NULL;
+	if (last && last[1] == hl && last[0] < 255)
+	{
+	    int take = 255 - last[0] < len ? 255 - last[0] : len;
+	    last[0] += take;
+	    len -= take;
+	}
+	else
+	{
+	    runs[*n * 2] = len < 255 ? len : 255;
+	    runs[*n * 2 + 1] = hl;
+	    len -= runs[*n * 2];
+	    (*n)++;
+	}
+    }
+}
+
+// the cells [from, oldTo) of the row become the "n" cells of "hl", the cells after them move.
+// "runs" is scratch memory for the new runs
+void editorRowPatchRuns(erow *row, int from, int oldTo, const unsigned char *hl, int n, unsigned char *runs)
+{
+    unsigned char *run;
+    unsigned char *end = row->hl + row->hlRuns * 2;
+    int cnt = 0;
+    int at = 0;
+
+    for (run = row->hl; run < end && at < from; at += run[0], run += 2)
+	hlRunPush(runs, &cnt, (at + run[0] < from ? at + run[0] : from) - at, run[1]);
+    if (at < from) { hlRunPush(runs, &cnt, from - at, HL_NORMAL); } // past the old runs
+
+    for (int i = 0; i < n; i++) { hlRunPush(runs, &cnt, 1, hl[i]); }
+
+    for (at = 0, run = row->hl; run < end; at += run[0], run += 2)
+    {
+	int a = at > oldTo ? at : oldTo;
+	if (at + run[0] > a) { hlRunPush(runs, &cnt, at + run[0] - a, run[1]); }
+    }
+    while (cnt && runs[(cnt - 1) * 2 + 1] == HL_NORMAL) { cnt--; }
+
+    if (cnt == 0)
+    {
+	rowFree(row->hl, row->hlRuns * 2);
+	row->hl = NULL;
+    }
+    else
+    {
+	row->hl = rowRealloc(row->hl, row->hlRuns * 2, cnt * 2);
+	memcpy(row->hl, runs, cnt * 2);
+    }
+    row->hlRuns = cnt;
+}
+
+// out of strings and comments, the highlighter starts again from a clean state after this char:
+// a separator that is not part of a keyword, of a number or of a comment delimiter
+int editorHighlightRestart(char c)
+{
+    struct editorSyntax *s = E.syntax;
+    if (s == NULL) { return 1; }
+    if (c == '\0' || c == '.' || !is_separator(c)) { return 0; }
+    if (s->trie && s->trie->alpha[(unsigned char)c]) { return 0; }
+
+    return !(s->single_line_comment_start && strchr(s->single_line_comment_start, c)) &&
+	!(s->multiline_comment_start && strchr(s->multiline_comment_start, c)) &&
+	!(s->multiline_comment_end && strchr(s->multiline_comment_end, c));
+}
+
+// same for a highlighted cell: HL_NORMAL is out of strings and comments
+int editorHighlightClean(char c, int hl)
+{
+    return hl == HL_NORMAL && editorHighlightRestart(c);
+}
+
+// "ins" cells were put at "rx" in place of "del" cells: highlight again only from the last 
+// clean cell before the edit to the first one after it that was clean also before the edit
+// ( the rest of the row is the same ). 0 if they are not found in KILO_HL_PATCH cells
+int editorHighlightPatch(erow *row, int rx, int ins, int del)
+{
+    int look = (E.syntax->trie ? E.syntax->trie->maxLen : 0) + 4; // lookahead of the highlighter
+    char *s = editorRowRender(row);
+    int len = row->rendersize;
+
+    int lo = rx > KILO_HL_PATCH ? rx - KILO_HL_PATCH : 0;
+    int e = rx + ins + KILO_HL_PATCH + look;
+    if (e > len) { e = len; }
+    int nOld = e - ins + del - lo; // old cells from lo ( same place before the edit )
+    int runsMax = row->hlRuns * 2 + (e - lo) + rx / 255 + 3;
+
+    unsigned char *old = editorHlScratch(nOld + (e - lo) + runsMax * 2);
+    unsigned char *hl = old + nOld;
+    unsigned char *runs = hl + (e - lo);
+    editorRowCells(row, lo, lo + nOld, old);
+
+    int ws;
+    for (ws = rx; ws > 0; ws--)
+    {
+	if (ws == lo) { return 0; }
+	if (editorHighlightClean(s[ws - 1], old[ws - 1 - lo])) { break; }
+    }
+
+    struct hlState st = { 0, 0 }; // a clean cell is out of strings and comments
+    struct hlState end = editorHighlightLine(&s[ws], e - ws, hl, ws == 0 ? row->hl_in : st);
+
+    int q;
+    int qmax = (e == len) ? len : e - look; // cells decided without the text cut at "e"
+    for (q = rx + ins + 1; q <= qmax; q++)
+    {
+	if (editorHighlightClean(s[q - 1], hl[q - 1 - ws]) && 
+	    editorHighlightClean(s[q - 1], old[q - 1 - ins + del - lo])) { break; }
+    }
+    if (q > qmax) // to the end of the row: the comment state at the end must not change
+    {
+	if (e < len || !hlStateEq(end, row->hl_out)) { return 0; }
+	q = len;
+    }
+
+    editorRowPatchRuns(row, ws, q - ins + del, hl, q - ws, runs);
+    return 1;
+}
+
+int editorSyntaxToColor(int hl)
+{
+    switch (hl) 
+    {
+	case HL_COMMENT:
+	case HL_MLCOMMENT: return 242;
+	case HL_KEYWORD1: return 211;
+	case HL_KEYWORD2: return 147; //111
+	case HL_KEYWORD3: return 180;
+	case HL_STRING: return 108;
+	case HL_NUMBER: 
+	case HL_KEYWORD4: return 218;
+	case HL_MATCH: return 197;
+	
+	default: return 37;
+    }
+}
+
+unsigned int syntaxHashStr(const char *s)
+{
+    unsigned int h = 2166136261u; // FNV-1a
+    for (; *s; s++) { h = (h ^ (unsigned char)*s) * 16777619u; }
+    return h;
+}
+
+// syntax of the filename extension "ext" ( with the dot )
+struct editorSyntax *syntaxHashFind(const char *ext)
+{
+    if (E.syntaxHashSize == 0) { return NULL; }
+
+    unsigned int i = syntaxHashStr(ext) & (E.syntaxHashSize - 1);
+    for (; E.syntaxHash[i].ext; i = (i + 1) & (E.syntaxHashSize - 1))
+    {
+	if (!strcmp(E.syntaxHash[i].ext, ext)) { return E.syntaxHash[i].syntax; }
+    }
+    return NULL;
+}
+
+// the extensions of all the syntaxes in the hash ( the first syntax with an extension has it )
+void syntaxHashBuild()
+{
+    int n = 0;
+    for (int j = 0; j < E.nsyntaxes; j++)
+    {
+	for (char **m = E.syntaxes[j].filematch; *m; m++) { n++; }
+    }
+    int size = 16;
+    while (size < n * 2) { size *= 2; }
+
+    free(E.syntaxHash);
+    E.syntaxHash = calloc(size, sizeof(struct syntaxExt));
+    if (E.syntaxHash == NULL) { die("calloc"); }
+    E.syntaxHashSize = size;
+
+    for (int j = 0; j < E.nsyntaxes; j++)
+    {
+	for (char **m = E.syntaxes[j].filematch; *m; m++)
+	{
+	    if ((*m)[0] != '.' || syntaxHashFind(*m)) { continue; }
+
+	    unsigned int i = syntaxHashStr(*m) & (size - 1);
+	    while (E.syntaxHash[i].ext) { i = (i + 1) & (size - 1); }
+	    E.syntaxHash[i].ext = *m;
+	    E.syntaxHash[i].syntax = &E.syntaxes[j];
+	}
+    }
+}
+
+void editorSelectSyntaxHighlight()
+{
+    editorSyntaxJobStop(); // the worker reads E.syntax
+    E.syntax = NULL;
+    if (E.filename == NULL) { return; }
+
     char *ext = strrchr(E.filename, '.');
+    struct editorSyntax *s = ext ? syntaxHashFind(ext) : NULL;
+    for (int j = 0; s == NULL && j < E.nsyntaxes; j++) // names found anywhere in the filename
+    {
+	for (char **m = E.syntaxes[j].filematch; *m; m++)
+	{
+	    if ((*m)[0] != '.' && strstr(E.filename, *m)) 
+	    { 
+		s = &E.syntaxes[j]; 
+		break; 
+	    }
+	}
+    }
+    if (s == NULL) { return; }
+
+    E.syntax = s;
+    editorKeywordCompile(s);
+
+    // highlighted again when shown
+    struct rowBlock *b;
+    for (b = blockFirst(); b; b = blockNext(b))
+    {
+	for (int j = 0; b->rows && j < b->nrows; j++)
+	    b->rows[j].hl_valid = 0;
+    }
+    E.hlFrontier = 0;
+    E.hlState = (struct hlState){ 0, 0 };
+}
+
+
+/*************************************************************************/
+/********* Syntax files **************************************************/
+// a file for each filetype in the syntax directory ( "*.syntax" ), one directive a line:
+//
+//   filetype python
+//   match .py .pyw SConstruct    ( ".ext" = extension, else found anywhere in the filename )
+//   comment #
+//   multiline """ """
+//   flags numbers strings
+//   separators ,.()+-/*=~%<>[];"  ( besides the spaces )
+//   keyword1 if else while       ( keyword1..4 = the class, as many lines as needed )
+//
+// They are compiled in packed tables, cached in the ".cache" file of the directory and used 
+// from there as they are ( mmap() ) until a syntax file changes. A filetype read from the files 
+// replaces the built-in one with the same name
+
+// a syntax file as read
+struct syntaxDef
+{
+    char *filetype;
+    char **match;
+    int nmatch;
+    char *comment[3];
+    int flags;
+    char *separators;
+    char **keywords;
+    unsigned char *classes;
+    int nkeywords;
+};
+
+struct syntaxBlob
+{
+    char *b;
+    int len;
+    int cap;
+};
+
+char *syntaxStrdup(const char *s)
+{
+    char *d = strdup(s);
+    if (d == NULL) { die("strdup"); }
+    return d;
+}
+
+void syntaxPush(char ***list, int *n, const char *s)
+{
+    if ((*n & (*n - 1)) == 0) // grows at 1, 2, 4...
+    {
+	*list = realloc(*list, (*n ? *n * 2 : 1) * sizeof(char *));
+	if (*list == NULL) { die("realloc"); }
+    }
+    (*list)[(*n)++] = syntaxStrdup(s);
+}
+
+// read a syntax file, 0 if it doesn't name a filetype and what it matches
+int syntaxRead(const char *path, struct syntaxDef *d)
+{
+    memset(d, 0, sizeof(*d));
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) { return 0; }
+
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, fp) != -1)
+    {
+	char *words[64];
+	int n = 0;
+	for (char *w = strtok(line, " \t\r\n"); w && n < 64; w = strtok(NULL, " \t\r\n")) { words[n++] = w; }
+	if (n < 2 || words[0][0] == '#') { continue; }
+
+	char *dir = words[0];
+	if (!strcmp(dir, "filetype")) { free(d->filetype); d->filetype = syntaxStrdup(words[1]); }
+	else if (!strcmp(dir, "match")) { for (int j = 1; j < n; j++) { syntaxPush(&d->match, &d->nmatch, words[j]); } }
+	else if (!strcmp(dir, "comment")) { free(d->comment[0]); d->comment[0] = syntaxStrdup(words[1]); }
+	else if (!strcmp(dir, "multiline") && n >= 3)
+	{
+	    free(d->comment[1]);
+	    free(d->comment[2]);
+	    d->comment[1] = syntaxStrdup(words[1]);
+	    d->comment[2] = syntaxStrdup(words[2]);
+	}
+	else if (!strcmp(dir, "flags"))
+	{
+	    for (int j = 1; j < n; j++)
+	    {
+		if (!strcmp(words[j], "numbers")) { d->flags |= HL_HIGHLIGHT_NUMBERS; }
+		if (!strcmp(words[j], "strings")) { d->flags |= HL_HIGHLIGHT_STRINGS; }
+	    }
+	}
+	else if (!strcmp(dir, "separators")) { free(d->separators); d->separators = syntaxStrdup(words[1]); }
+	else if (!strncmp(dir, "keyword", 7) && dir[7] >= '1' && dir[7] <= '4' && dir[8] == '\0')
+	{
+	    for (int j = 1; j < n; j++)
+	    {
+		int at = d->nkeywords;
+		syntaxPush(&d->keywords, &d->nkeywords, words[j]);
+		if ((at & (at - 1)) == 0) 
+		{ 
+		    d->classes = realloc(d->classes, at ? at * 2 : 1); 
+		    if (d->classes == NULL) { die("realloc"); }
+		}
+		d->classes[at] = HL_KEYWORD1 + dir[7] - '1';
+	    }
+	}
+    }
+    free(line);
+    fclose(fp);
+    return d->filetype && d->nmatch;
+}
+
+void syntaxDefFree(struct syntaxDef *d)
+{
+    for (int j = 0; j < d->nmatch; j++) { free(d->match[j]); }
+    for (int j = 0; j < d->nkeywords; j++) { free(d->keywords[j]); }
+    for (int j = 0; j < 3; j++) { free(d->comment[j]); }
+    free(d->filetype);
+    free(d->match);
+    free(d->keywords);
+    free(d->classes);
+    free(d->separators);
+}
+
+// put "n" bytes in the blob at an 8 bytes boundary, return their offset
+int syntaxPut(struct syntaxBlob *blob, const void *p, int n)
+{
+    int at = (blob->len + 7) & ~7;
+    if (at + n > blob->cap)
+    {
+	blob->cap = (at + n) * 2;
+	blob->b = realloc(blob->b, blob->cap);
+	if (blob->b == NULL) { die("realloc"); }
+    }
+    memset(blob->b + blob->len, 0, at - blob->len);
+    if (p) { memcpy(blob->b + at, p, n); }
+    else { memset(blob->b + at, 0, n); }
+    blob->len = at + n;
+    return at;
+}
+
+int syntaxPutStr(struct syntaxBlob *blob, const char *s)
+{
+    return s ? syntaxPut(blob, s, strlen(s) + 1) : 0;
+}
+
+// compile the syntax files in a blob: header, a struct syntaxPacked for each syntax, their tables
+void syntaxCompile(struct syntaxBlob *blob, char **paths, int npaths, unsigned long long key)
+{
+    struct syntaxDef *defs = malloc((npaths + 1) * sizeof(struct syntaxDef));
+    if (defs == NULL) { die("malloc"); }
+    int n = 0;
+    for (int j = 0; j < npaths; j++)
+    {
+	if (syntaxRead(paths[j], &defs[n])) { n++; }
+	else { syntaxDefFree(&defs[n]); }
+    }
+
+    struct syntaxCacheHead head;
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, "KILOSYN1", 8);
+    head.key = key;
+    head.nsyntax = n;
+    syntaxPut(blob, &head, sizeof(head));
+    int recs = syntaxPut(blob, NULL, n * sizeof(struct syntaxPacked));
+
+    for (int j = 0; j < n; j++)
+    {
+	struct syntaxDef *d = &defs[j];
+	struct syntaxPacked p;
+	memset(&p, 0, sizeof(p));
+	p.filetype = syntaxPutStr(blob, d->filetype);
+	int len = 1;
+	for (int k = 0; k < d->nmatch; k++) { len += strlen(d->match[k]) + 1; }
+	p.filematch = syntaxPut(blob, NULL, len); // "name\0name\0...\0"
+	for (int k = 0, at = p.filematch; k < d->nmatch; k++)
+	{
+	    strcpy(blob->b + at, d->match[k]);
+	    at += strlen(d->match[k]) + 1;
+	}
+	for (int k = 0; k < 3; k++) { p.comment[k] = syntaxPutStr(blob, d->comment[k]); }
+	p.flags = d->flags;
+	editorSeparatorsCompile(p.sep, d->separators ? d->separators : KILO_SEPARATORS);
+
+	struct kwTrie *t = kwTrieBuild(d->keywords, d->classes, d->nkeywords);
+	memcpy(p.alpha, t->alpha, 256);
+	p.nalpha = t->nalpha;
+	p.nnodes = t->nnodes;
+	p.maxLen = t->maxLen;
+	p.next = syntaxPut(blob, t->next, t->nnodes * t->nalpha * sizeof(int));
+	p.hlClass = syntaxPut(blob, t->hlClass, t->nnodes);
+	p.order = syntaxPut(blob, t->order, t->nnodes * sizeof(int));
+	free(t->next);
+	free(t->hlClass);
+	free(t->order);
+	free(t);
+
+	memcpy(blob->b + recs + j * sizeof(struct syntaxPacked), &p, sizeof(p));
+	syntaxDefFree(d);
+    }
+    free(defs);
+
+    syntaxPut(blob, "", 1); // strings end before the end of the blob
+    ((struct syntaxCacheHead *)blob->b)->size = blob->len;
+}
+
+// the trie of a packed syntax can be walked as it is: every edge goes to a later node ( no 
+// loops ), the classes are keyword classes and maxLen is the longest keyword
+int syntaxTrieOk(const char *b, const struct syntaxPacked *p)
+{
+    const int *next = (const int *)(b + p->next);
+    const unsigned char *hlClass = (const unsigned char *)(b + p->hlClass);
+    const int *order = (const int *)(b + p->order);
+    int *depth = calloc(p->nnodes, sizeof(int));
+    if (depth == NULL) { die("calloc"); }
+
+    int ok = hlClass[0] == 0;
+    int maxLen = 0;
+    for (int n = 0; ok && n < p->nnodes; n++)
+    {
+	if (hlClass[n] && (hlClass[n] < HL_KEYWORD1 || hlClass[n] > HL_KEYWORD4 || order[n] < 0)) { ok = 0; }
+	if (hlClass[n] && depth[n] > maxLen) { maxLen = depth[n]; }
+	for (int a = 0; ok && a < p->nalpha; a++)
+	{
+	    int to = next[n * p->nalpha + a];
+	    if (to == 0) { continue; }
+	    if (to <= n || to >= p->nnodes) { ok = 0; }
+	    else if (depth[to] < depth[n] + 1) { depth[to] = depth[n] + 1; }
+	}
+    }
+    free(depth);
+    return ok && maxLen == p->maxLen;
+}
+
+// the blob was read from disk: every table is inside it
+int syntaxBlobOk(const char *b, int size, unsigned long long key)
+{
+    const struct syntaxCacheHead *h = (const struct syntaxCacheHead *)b;
+    if (size < (int)sizeof(*h) || memcmp(h->magic, "KILOSYN1", 8) || h->key != key || h->size != size) { return 0; }
+    if (h->nsyntax < 0 || h->nsyntax > (size - (int)sizeof(*h)) / (int)sizeof(struct syntaxPacked)) { return 0; }
+    if (b[size - 1] != '\0') { return 0; }
+
+    const struct syntaxPacked *p = (const struct syntaxPacked *)(h + 1);
+    for (int j = 0; j < h->nsyntax; j++, p++)
+    {
+	long long edges = (long long)p->nnodes * p->nalpha;
+	if (p->filetype <= 0 || p->filetype >= size || p->filematch <= 0 || p->filematch >= size) { return 0; }
+	if (p->nalpha < 1 || p->nalpha > 256 || p->nnodes < 1 || edges > size) { return 0; }
+	if (p->next <= 0 || p->next % sizeof(int) || p->next + edges * (int)sizeof(int) > size) { return 0; }
+	if (p->hlClass <= 0 || p->hlClass + p->nnodes > size) { return 0; }
+	if (p->order <= 0 || p->order % sizeof(int) || p->order + (long long)p->nnodes * (int)sizeof(int) > size) { return 0; }
+	for (int k = 0; k < 3; k++) { if (p->comment[k] < 0 || p->comment[k] >= size) { return 0; } }
+	for (int k = 0; k < 256; k++) { if (p->alpha[k] >= p->nalpha) { return 0; } }
+
+	int at = p->filematch; // the patterns and the empty one at the end are in the blob
+	while (at < size && b[at] != '\0') { at += strnlen(b + at, size - at) + 1; }
+	if (at >= size) { return 0; }
+
+	if (!syntaxTrieOk(b, p)) { return 0; }
+    }
+    return 1;
+}
+
+// the syntaxes of a blob join the built-in ones: they point into the blob ( kept for ever )
+void syntaxUse(char *b)
+{
+    struct syntaxCacheHead *h = (struct syntaxCacheHead *)b;
+    struct syntaxPacked *p = (struct syntaxPacked *)(h + 1);
+
+    for (int j = 0; j < h->nsyntax; j++, p++)
+    {
+	struct editorSyntax s;
+	memset(&s, 0, sizeof(s));
+	s.filetype = b + p->filetype;
+
+	int n = 0;
+	for (char *m = b + p->filematch; *m; m += strlen(m) + 1) { n++; }
+	s.filematch = malloc((n + 1) * sizeof(char *));
+	if (s.filematch == NULL) { die("malloc"); }
+	n = 0;
+	for (char *m = b + p->filematch; *m; m += strlen(m) + 1) { s.filematch[n++] = m; }
+	s.filematch[n] = NULL;
+
+	s.single_line_comment_start = p->comment[0] ? b + p->comment[0] : NULL;
+	s.multiline_comment_start = p->comment[1] ? b + p->comment[1] : NULL;
+	s.multiline_comment_end = p->comment[2] ? b + p->comment[2] : NULL;
+	s.flags = p->flags;
+	memcpy(s.sep, p->sep, 32);
+
+	s.trie = calloc(1, sizeof(struct kwTrie));
+	if (s.trie == NULL) { die("calloc"); }
+	memcpy(s.trie->alpha, p->alpha, 256);
+	s.trie->nalpha = p->nalpha;
+	s.trie->nnodes = p->nnodes;
+	s.trie->maxLen = p->maxLen;
+	s.trie->next = (int *)(b + p->next);
+	s.trie->hlClass = (unsigned char *)(b + p->hlClass);
+	s.trie->order = (int *)(b + p->order);
+
+	int k;
+	for (k = 0; k < E.nsyntaxes; k++) // same filetype: replaced
+	{
+	    if (!strcmp(E.syntaxes[k].filetype, s.filetype)) { break; }
+	}
+	if (k == E.nsyntaxes)
+	{
+	    E.syntaxes = realloc(E.syntaxes, (E.nsyntaxes + 1) * sizeof(struct editorSyntax));
+	    if (E.syntaxes == NULL) { die("realloc"); }
+	    E.nsyntaxes++;
+	}
+	E.syntaxes[k] = s;
+    }
+}
+
+int syntaxNameCmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// the built-in syntaxes and the ones of the syntax files: from the cache if it's still good 
+// ( a stat() for each file ), else compiled and cached again
+void editorSyntaxLoad()
+{
+    E.nsyntaxes = HLDB_ENTRIES;
+    E.syntaxes = malloc(HLDB_ENTRIES * sizeof(struct editorSyntax));
+    if (E.syntaxes == NULL) { die("malloc"); }
+    memcpy(E.syntaxes, HLDB, sizeof(HLDB));
+
+    char dir[4096];
+    char *home = getenv("HOME");
+    if (getenv("KILO_SYNTAX_DIR")) { snprintf(dir, sizeof(dir), "%s", getenv("KILO_SYNTAX_DIR")); }
+    else if (home) { snprintf(dir, sizeof(dir), "%s/%s", home, KILO_SYNTAX_DIR); }
+    else { dir[0] = '\0'; }
+
+    DIR *d = dir[0] ? opendir(dir) : NULL;
+    if (d == NULL) 
+    { 
+	syntaxHashBuild();
+	return; 
+    }
+
+    char **paths = NULL;
+    int npaths = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL)
+    {
+	size_t len = strlen(e->d_name);
+	if (len <= 7 || e->d_name[0] == '.' || strcmp(e->d_name + len - 7, ".syntax")) { continue; }
+
+	char path[4096 + 256];
+	snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+	syntaxPush(&paths, &npaths, path);
+    }
+    closedir(d);
+    if (npaths) { qsort(paths, npaths, sizeof(char *), syntaxNameCmp); }
+
+    // the cache key: names, mtimes and sizes ( and the layout of the tables )
+    unsigned long long key = 14695981039346656037ull ^ sizeof(struct syntaxPacked);
+    for (int j = 0; j < npaths; j++)
+    {
+	struct stat st;
+	if (stat(paths[j], &st) == -1) { continue; }
+	unsigned long long v[3] = { st.st_mtim.tv_sec, st.st_mtim.tv_nsec, st.st_size };
+	for (char *c = paths[j]; *c; c++) { key = (key ^ (unsigned char)*c) * 1099511628211ull; }
+	for (int k = 0; k < 3; k++) { key = (key ^ v[k]) * 1099511628211ull; }
+    }
+
+    char cache[4096 + 16];
+    snprintf(cache, sizeof(cache), "%s/.cache", dir);
+    char *b = NULL;
+    int fd = open(cache, O_RDONLY);
+    if (fd != -1)
+    {
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size < (1 << 30))
+	{
+	    b = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	    if (b == MAP_FAILED) { b = NULL; }
+	    else if (!syntaxBlobOk(b, st.st_size, key))
+	    {
+		munmap(b, st.st_size);
+		b = NULL;
+	    }
+	}
+	close(fd);
+    }
+
+    if (b == NULL) // compiled and written in a temp file renamed over the old cache
+    {
+	struct syntaxBlob blob = { NULL, 0, 0 };
+	syntaxCompile(&blob, paths, npaths, key);
+	b = blob.b;
+
+	char tmp[4096 + 32];
+	snprintf(tmp, sizeof(tmp), "%s/.cache.XXXXXX", dir);
+	fd = mkstemp(tmp);
+	if (fd != -1)
+	{
+	    int ok = write(fd, blob.b, blob.len) == blob.len;
+	    if (close(fd) == -1 || !ok || rename(tmp, cache) == -1) { unlink(tmp); }
+	}
+    }
+
+    for (int j = 0; j < npaths; j++) { free(paths[j]); }
+    free(paths);
+    syntaxUse(b);
+    syntaxHashBuild();
+}
+
+
+/*************************************************************************/
+/********* Row operation *************************************************/
+// what is shown of the row ( tabs expanded )
+char *editorRowRender(erow *row)
+{
+    return row->render ? row->render : row->chars;
+}
+
+// from the last tab before cx ( binary search in the tabs of the row )
+int editorRowCxToRx(erow *row, int cx)
+{
+    int lo = 0, hi = row->ntabs;
+    while (lo < hi)
+    {
+	int mid = (lo + hi) / 2;
+	if (row->tabs[mid * 2] < cx) { lo = mid + 1; }
+	else { hi = mid; }
+    }
+    if (lo == 0) { return cx; }
+
+    int *tab = &row->tabs[(lo - 1) * 2];
+    return tab[1] + cx - tab[0] - 1;
+}
+
+// from the last tab ending before rx: the char at rx, or the tab covering it
+int editorRowRxToCx(erow *row, int rx)
+{
+    int lo = 0, hi = row->ntabs;
+    while (lo < hi)
+    {
+	int mid = (lo + hi) / 2;
+	if (row->tabs[mid * 2 + 1] <= rx) { lo = mid + 1; }
+	else { hi = mid; }
+    }
+
+    int cx = rx;
+    if (lo > 0) { cx = row->tabs[(lo - 1) * 2] + 1 + rx - row->tabs[(lo - 1) * 2 + 1]; }
+    if (lo < row->ntabs && cx > row->tabs[lo * 2]) { cx = row->tabs[lo * 2]; }
+    return cx < row->size ? cx : row->size;
+}
+
+void editorLongFree(erow *row)
+{
+    struct longRow *w = row->wide;
+    if (w == NULL) { return; }
+
+    free(w->marks);
+    free(w->winText);
+    free(w->winRuns);
+    free(w);
+    row->wide = NULL;
+}
+
+void editorRenderRow(erow *row) // from chars to render (proper content VS render mode)
+{
+    int tabs = 0;
+    char *p = row->chars;
+    char *end = row->chars + row->size;
+    while ((p = memchr(p, '\t', end - p)) != NULL) 
+    { 
+	tabs++; 
+	p++; 
+    }
+
+    row->hl_valid = 0;
+    if (tabs != row->ntabs)
+    {
+	if (tabs == 0)
+	{
+	    rowFree(row->tabs, row->ntabs * 2 * sizeof(int));
+	    row->tabs = NULL;
+	}
+	else
+	{
+	    row->tabs = rowRealloc(row->tabs, row->ntabs * 2 * sizeof(int), tabs * 2 * sizeof(int));
+	}
+	row->ntabs = tabs;
+    }
+
+    // where the tabs are and the cell after each of them
+    int rendersize = 0; // exact: the buffers are freed with their size
+    int *tab = row->tabs;
+    int j = 0;
+    for (p = row->chars; (p = memchr(p, '\t', end - p)) != NULL; p++)
+    {
+	rendersize += (p - row->chars) - j;
+	rendersize += KILO_TAB_STOP - rendersize % KILO_TAB_STOP;
+	j = p - row->chars + 1;
+	*tab++ = j - 1;
+	*tab++ = rendersize;
+    }
+    rendersize += row->size - j;
+
+    if (rendersize > KILO_LONG_LINE) // only the cells on screen are made ( editorLongWindow() )
+    {
+	if (row->wide == NULL)
+	{
+	    row->wide = calloc(1, sizeof(struct longRow));
+	    if (row->wide == NULL) { die("calloc"); }
+
+	    // runs of the whole row are never used again: the window has its own
+	    rowFree(row->hl, row->hlRuns * 2);
+	    row->hl = NULL;
+	    row->hlRuns = 0;
+	    row->hl_valid = 0;
+	}
+	row->wide->nmarks = 0;
+	row->wide->winValid = 0;
+	tabs = 0;
+    }
+    else 
+    {
+	editorLongFree(row);
+    }
+
+    if (tabs == 0) // chars are shown as they are
+    {
+	if (row->render) { rowFree(row->render, row->rendersize + 1); }
+	row->render = NULL;
+	row->rendersize = rendersize;
+	return;
+    }
+    // in place for small changes
+    row->render = rowRealloc(row->render, row->render ? row->rendersize + 1 : 0, rendersize + 1);
+
+    int idx = 0;
+    j = 0;
+    for (int t = 0; t < row->ntabs; t++) // chars up to the tab, then spaces to the next tab stop
+    {
+	tab = &row->tabs[t * 2];
+	memcpy(&row->render[idx], &row->chars[j], tab[0] - j);
+	idx += tab[0] - j;
+	memset(&row->render[idx], ' ', tab[1] - idx);
+	idx = tab[1];
+	j = tab[0] + 1;
+    }
+    memcpy(&row->render[idx], &row->chars[j], row->size - j);
+    idx += row->size - j;
+
+    row->render[idx] = '\0';
+    row->rendersize = idx;
+}
+
+void editorUpdateRow(erow *row)
+{
+    editorRenderRow(row);
+    editorUpdateSyntax(row);
+}
+
+// "ins" chars were put at "at" in place of "del" ( "tabs" if a tab is among them ): render and hl
+// are patched around the edit, the tabs of the row stay where they are. A full update when the 
+// row has tabs after the edit or the highlight changes past the patched cells
+void editorRowPatch(erow *row, int at, int ins, int del, int tabs)
+{
+    if (tabs || row->wide || row->rendersize + ins - del > KILO_LONG_LINE ||
+	(row->render && memchr(&row->chars[at + ins], '\t', row->size - at - ins)))
+    {
+	editorUpdateRow(row);
+	return;
+    }
+
+    int rx = at;
+    if (row->render) // tabs before the edit: the cells after it only move
+    {
+	rx = editorRowCxToRx(row, at);
+	int rendersize = row->rendersize + ins - del;
+	if (ins > del) { row->render = rowRealloc(row->render, row->rendersize + 1, rendersize + 1); }
+	memmove(&row->render[rx + ins], &row->render[rx + del], row->rendersize - rx - del + 1);
+	memcpy(&row->render[rx], &row->chars[at], ins);
+	if (ins < del) { row->render = rowRealloc(row->render, row->rendersize + 1, rendersize + 1); }
+    }
+    row->rendersize += ins - del;
+
+    if (E.syntax == NULL) { return; } // no runs: all HL_NORMAL
+    if (!row->hl_valid) // highlighted when shown
+    {
+	editorSyntaxInvalidate(editorRowIndex(row));
+	return;
+    }
+    if (!editorHighlightPatch(row, rx, ins, del)) { editorUpdateSyntax(row); }
+}
+
+void editorInitRow(erow *row, char *s, size_t len)
+{
+    row->size = len;
+    row->chars = rowAlloc(len + 1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+
+    row->rendersize = len; // no render yet: chars are all there is
+    row->render = NULL;
+    row->tabs = NULL;
+    row->ntabs = 0;
+    row->wide = NULL;
+    row->hl = NULL;
+    row->hlRuns = 0;
+    row->hl_in = (struct hlState){ 0, 0 };
+    row->hl_out = row->hl_in;
+    row->hl_valid = 0;
+    row->snapGen = 0;
+}
+
+void editorInsertRow(int at, char *s, size_t len)
+{
+    if (at < 0 || at > E.numTextRows) { return; }
+
+    undoRecord(UNDO_INSERT_ROW, at, 0, s, len);
+    erow *row = editorOpenRow(at); //add 1 line space (only moves the rows of one block)
+    editorInitRow(row, s, len);
+    editorRenderRow(row); // highlighted when shown
+    editorSyntaxInvalidate(at);
+
+    E.dirty++;
+}
+
+void editorFreeRow(erow *row)
+{
+    // allocated with "rowAlloc()"
+    editorRowDetach(row); // chars kept for the save in progress
+    rowFree(row->render, row->rendersize + 1); 
+    rowFree(row->chars, row->size + 1);
+    rowFree(row->hl, row->hlRuns * 2);
+    rowFree(row->tabs, row->ntabs * 2 * sizeof(int));
+    editorLongFree(row);
+}
+
+void editorDeleteRow(int at)
+{
+    if (at < 0 || at >= E.numTextRows) { return; }
+
+    erow *row = editorRowAt(at);
+    undoRecord(UNDO_DELETE_ROW, at, 0, row->chars, row->size);
+    editorFreeRow(row);
+    editorCloseRow(at);
+    editorSyntaxInvalidate(at);
+    E.dirty++;
+}
+
+// the two primitives changing the chars of a row ( journaled for undo ):
+// only the chars, render and highlight left to the caller
+void editorRowInsertString(erow *row, int at, const char *s, size_t len)
+{
+    undoRecord(UNDO_INSERT, editorRowIndex(row), at, s, len);
+    editorRowDetach(row);
+    row->chars = rowRealloc(row->chars, row->size + 1, row->size + len + 1);
+
+    // "memmove" is like "memcpy" but safer if src and dest overlap
+    memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1); // (+1 is the '\0')
+    memcpy(&row->chars[at], s, len);
+    row->size += len;
+}
+
+void editorRowDeleteString(erow *row, int at, size_t len)
+{
+    undoRecord(UNDO_DELETE, editorRowIndex(row), at, &row->chars[at], len);
+    editorRowDetach(row);
+    memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+    row->chars = rowRealloc(row->chars, row->size + 1, row->size - len + 1);
+    row->size -= len;
+}
+
+void editorRowAppend(erow *row, const char *s, size_t len)
+{
+    editorRowInsertString(row, row->size, s, len); // copy to end of line
+}
+
+// the row ends at "at"
+void editorRowTruncate(erow *row, int at)
+{
+    editorRowDeleteString(row, at, row->size - at);
+}
+
+// for when Delete at the begin of line: append the content of current line to the previous line + remove the current line
+void editorRowAppendString(erow *row, char *s, size_t len)
+{
+    editorRowAppend(row, s, len);
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+void editorRowInsertChar(erow *row, int at, int c)
+{
+    if (at < 0 || at > row->size) { at = row->size; }
+    char ch = c;
+    editorRowInsertString(row, at, &ch, 1);
+    editorRowPatch(row, at, 1, 0, c == '\t');
+    E.dirty++;
+}
+
+void editorRowDeleteChar(erow *row, int at)
+{
+    if (at < 0 || at >= row->size) { return; }
+
+    int tab = row->chars[at] == '\t';
+    editorRowDeleteString(row, at, 1);
+    editorRowPatch(row, at, 0, 1, tab);
+    E.dirty++;
+}
+
+/*************************************************************************/
+/********* Editor operations *********************************************/
+void editorInsertChar(int c)
+{
+    if (E.cy == E.numTextRows) { editorInsertRow(E.numTextRows, "", 0); } // on ~ line
+
+    editorRowInsertChar(editorRowAt(E.cy), E.cx, c); // insert char at cursor pos
+    E.cx++;
+}
+
+void editorDeleteChar()
+{
+    if (E.cy == E.numTextRows) { return; }
+    if (E.cx == 0 && E.cy == 0) { return; }
+
+    erow *row = editorRowAt(E.cy);
+    if (E.cx  > 0)
+    {
+	editorRowDeleteChar(row, E.cx - 1);
+	E.cx--;
+    }
+    else 
+    {
+	erow *prev = editorRowAt(E.cy - 1);
+	E.cx = prev->size;
+	editorRowAppendString(prev, row->chars, row->size);
+	editorDeleteRow(E.cy);
+	E.cy--;
+    }
+}
+
+void editorInsertNewLine()
+{
+    if (E.cx == 0)
+    {
+	editorInsertRow(E.cy, "", 0);
+    }
+    else 
+    {
+	erow *row = editorRowAt(E.cy);
+	// insert new row from current row[cursor pos] to end row (in the next line) 
+	editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx); //new row
+	
+	// stop current row at cursor pos
+	row = editorRowAt(E.cy);
+	editorRowTruncate(row, E.cx);
+	editorUpdateRow(row);
+    }
+    E.cy++;
+    E.cx = 0;
+}
+
+// insert a block of text at the cursor as one edit ( paste ): "\r", "\n" or "\r\n" start a new row.
+// rows are only rendered here, highlighted once when they reach the screen
+void editorInsertText(const char *s, size_t len)
+{
+    if (len == 0) { return; }
+    if (E.cy == E.numTextRows) { editorInsertRow(E.numTextRows, "", 0); }
+
+    erow *row = editorRowAt(E.cy);
+    if (!memchr(s, '\r', len) && !memchr(s, '\n', len)) // all in the row ( typing )
+    {
+	editorRowInsertString(row, E.cx, s, len);
+	editorRowPatch(row, E.cx, len, 0, memchr(s, '\t', len) != NULL);
+	E.cx += len;
+	E.dirty++;
+	return;
+    }
+
+    // the part after the cursor goes at the end of the last inserted row
+    size_t tailLen = row->size - E.cx;
+    char *tail = malloc(tailLen + 1);
+    if (tail == NULL) { die("malloc"); }
+    memcpy(tail, &row->chars[E.cx], tailLen);
+    editorRowTruncate(row, E.cx);
+
+    int at = E.cy;
+    size_t start = 0;
+    size_t i;
+    for (i = 0; i <= len; i++)
+    {
+	if (i < len && s[i] != '\r' && s[i] != '\n') { continue; }
+
+	if (at == E.cy) { editorRowAppend(editorRowAt(at), s, i); }
+	else { editorInsertRow(at, (char *)&s[start], i - start); }
+
+	if (i == len) { break; }
+	if (s[i] == '\r' && i + 1 < len && s[i + 1] == '\n') { i++; }
+	start = i + 1;
+	at++;
+    }
+
+    row = editorRowAt(at);
+    E.cx = row->size;
+    editorRowAppend(row, tail, tailLen);
+    free(tail);
+
+    editorRenderRow(editorRowAt(E.cy));
+    if (at != E.cy) { editorRenderRow(row); }
+    editorSyntaxInvalidate(E.cy);
+    E.cy = at;
+    E.dirty++;
+}
+
+
+/*************************************************************************/
+/********* Undo **********************************************************/
+// journal of the edits: the row primitives record what they change ( text inserted or deleted 
+// in a row, a row inserted or deleted ) with its bytes, in an arena used as a stack. 
+// A group is what a key did ( a run of typed chars is one group ): undo takes a group back, 
+// redo does it again, both in the size of the edit
+void undoReserve(struct undoStack *u, size_t extra)
+{
+    if (u->len + extra <= u->cap) { return; }
+
+    size_t cap = u->cap;
+    while (u->len + extra > cap) { cap = cap ? cap * 2 : 4096; }
+    char *b = realloc(u->b, cap);
+    if (b == NULL) { die("realloc"); }
+    u->b = b;
+    u->cap = cap;
+}
+
+// a record is: header, its bytes, its total size ( to walk back from the top )
+void undoPush(struct undoStack *u, struct undoRec *r, const char *s)
+{
+    int size = sizeof(*r) + r->len + sizeof(int);
+    undoReserve(u, size);
+    memcpy(u->b + u->len, r, sizeof(*r));
+    if (r->len) { memcpy(u->b + u->len + sizeof(*r), s, r->len); }
+    memcpy(u->b + u->len + size - sizeof(int), &size, sizeof(int));
+    u->len += size;
+}
+
+// last record ( copied in *r ) and its bytes, 0 if the stack is empty
+int undoTop(struct undoStack *u, struct undoRec *r, char **s)
+{
+    if (u->len == 0) { return 0; }
+
+    int size;
+    memcpy(&size, u->b + u->len - sizeof(int), sizeof(int));
+    memcpy(r, u->b + u->len - size, sizeof(*r));
+    *s = u->b + u->len - size + sizeof(*r);
+    return 1;
+}
+
+void undoPop(struct undoStack *u)
+{
+    int size;
+    memcpy(&size, u->b + u->len - sizeof(int), sizeof(int));
+    u->len -= size;
+}
+
+// more bytes in the last record: before its bytes ( "front", starting now at "col" ) or after
+void undoExtend(struct undoStack *u, const char *s, int len, int front, int col)
+{
+    int size;
+    memcpy(&size, u->b + u->len - sizeof(int), sizeof(int));
+    size_t at = u->len - size;
+    undoReserve(u, len);
+
+    struct undoRec r;
+    memcpy(&r, u->b + at, sizeof(r));
+    char *bytes = u->b + at + sizeof(r);
+    if (front) 
+    { 
+	memmove(bytes + len, bytes, r.len); 
+	memcpy(bytes, s, len); 
+	r.col = col; 
+    }
+    else 
+    { 
+	memcpy(bytes + r.len, s, len); 
+    }
+    r.len += len;
+    size += len;
+    memcpy(u->b + at, &r, sizeof(r));
+    memcpy(u->b + at + size - sizeof(int), &size, sizeof(int));
+    u->len += len;
+}
+
+// over KILO_UNDO_BYTES: the oldest groups go, down to 3/4 of it
+void undoTrim()
+{
+    struct undoStack *u = &E.undo;
+    if (u->len <= KILO_UNDO_BYTES) { return; }
+
+    size_t target = u->len - KILO_UNDO_BYTES / 4 * 3;
+    size_t off = 0;
+    while (off < u->len)
+    {
+	struct undoRec r;
+	memcpy(&r, u->b + off, sizeof(r));
+	if (r.type == UNDO_GROUP && off >= target) { break; }
+	off += sizeof(r) + r.len + sizeof(int);
+    }
+
+    if (E.undoGroupAt < off) // the group being recorded is too big: the rest of it is not kept
+    {
+	E.undoOpen = 0;
+	E.undoSkip = 1;
+    }
+    E.undoGroupAt -= off;
+    memmove(u->b, u->b + off, u->len - off);
+    u->len -= off;
+}
+
+// next edit starts a new group ( called for every key that isn't part of a run )
+void editorUndoBreak()
+{
+    if (E.undoOpen) // cursor after the group, for the redo
+    {
+	struct undoRec g;
+	memcpy(&g, E.undo.b + E.undoGroupAt, sizeof(g));
+	g.cx = E.cx;
+	g.cy = E.cy;
+	memcpy(E.undo.b + E.undoGroupAt, &g, sizeof(g));
+    }
+    E.undoOpen = 0;
+    E.undoSkip = 0;
+    E.undoCx = E.cx;
+    E.undoCy = E.cy;
+}
+
+void undoRecord(int type, int row, int col, const char *s, int len)
+{
+    if (E.undoLock || E.undoSkip) { return; }
+
+    E.redo.len = 0; // a new edit: what was undone can't be done again
+    if (!E.undoOpen)
+    {
+	struct undoRec g = { UNDO_GROUP, E.undoCy, E.undoCx, 0, E.undoCx, E.undoCy, ++E.undoSeq, E.undoPos };
+	E.undoPos = g.id;
+	E.undoGroupAt = E.undo.len;
+	undoPush(&E.undo, &g, NULL);
+	E.undoOpen = 1;
+    }
+
+    // chars typed or deleted one after the other go in the same record
+    struct undoRec last;
+    char *bytes;
+    undoTop(&E.undo, &last, &bytes);
+    if (type == UNDO_INSERT && last.type == UNDO_INSERT && last.row == row && last.col + last.len == col)
+    {
+	undoExtend(&E.undo, s, len, 0, col);
+    }
+    else if (type == UNDO_DELETE && last.type == UNDO_DELETE && last.row == row && col + len == last.col)
+    {
+	undoExtend(&E.undo, s, len, 1, col); // backspace
+    }
+    else if (type == UNDO_DELETE && last.type == UNDO_DELETE && last.row == row && col == last.col)
+    {
+	undoExtend(&E.undo, s, len, 0, col); // delete
+    }
+    else
+    {
+	struct undoRec r = { type, row, col, len, 0, 0, 0, 0 };
+	undoPush(&E.undo, &r, s);
+    }
+    undoTrim();
+}
+
+// do a record again, or take it back
+void undoApply(struct undoRec *r, const char *s, int back)
+{
+    int type = r->type;
+    if (back)
+    {
+	switch (type)
+	{
+	    case UNDO_INSERT: type = UNDO_DELETE; break;
+	    case UNDO_DELETE: type = UNDO_INSERT; break;
+	    case UNDO_INSERT_ROW: type = UNDO_DELETE_ROW; break;
+	    case UNDO_DELETE_ROW: type = UNDO_INSERT_ROW; break;
+	}
+    }
+
+    erow *row;
+    switch (type)
+    {
+	case UNDO_INSERT:
+	    row = editorRowAt(r->row);
+	    editorRowInsertString(row, r->col, s, r->len);
+	    editorRenderRow(row);
+	    editorSyntaxInvalidate(r->row);
+	    break;
+	case UNDO_DELETE:
+	    row = editorRowAt(r->row);
+	    editorRowDeleteString(row, r->col, r->len);
+	    editorRenderRow(row);
+	    editorSyntaxInvalidate(r->row);
+	    break;
+	case UNDO_INSERT_ROW:
+	    editorInsertRow(r->row, (char *)s, r->len);
+	    break;
+	case UNDO_DELETE_ROW:
+	    editorDeleteRow(r->row);
+	    break;
+    }
+}
+
+void editorUndoCursor(int cx, int cy)
+{
+    E.cy = cy;
+    erow *row = editorRowAt(E.cy);
+    E.cx = row ? (cx < row->size ? cx : row->size) : 0;
+}
+
+void editorUndo()
+{
+    struct undoRec r;
+    char *s;
+    if (!undoTop(&E.undo, &r, &s)) 
+    { 
+	editorSetStatusMessage("Nothing to undo"); 
+	return; 
+    }
+
+    E.undoLock++;
+    while (undoTop(&E.undo, &r, &s))
+    {
+	if (r.type == UNDO_GROUP) // the first record of the group: done
+	{
+	    undoPush(&E.redo, &r, NULL);
+	    undoPop(&E.undo);
+	    editorUndoCursor(r.col, r.row);
+	    E.undoPos = r.before;
+	    break;
+	}
+	undoApply(&r, s, 1);
+	undoPush(&E.redo, &r, s);
+	undoPop(&E.undo);
+    }
+    E.undoLock--;
+    E.dirty = E.undoPos != E.undoSaved; // back to the text on disk: not modified
+}
+
+void editorRedo()
+{
+    struct undoRec g, r;
+    char *s;
+    if (!undoTop(&E.redo, &g, &s)) 
+    { 
+	editorSetStatusMessage("Nothing to redo"); 
+	return; 
+    }
+
+    E.undoLock++;
+    undoPush(&E.undo, &g, NULL);
+    undoPop(&E.redo);
+    while (undoTop(&E.redo, &r, &s) && r.type != UNDO_GROUP)
+    {
+	undoApply(&r, s, 0);
+	undoPush(&E.undo, &r, s);
+	undoPop(&E.redo);
+    }
+    E.undoLock--;
+    editorUndoCursor(g.cx, g.cy);
+    E.undoPos = g.id;
+    E.dirty = E.undoPos != E.undoSaved;
+}
+
+
+/*************************************************************************/
+/********* File I/O ******************************************************/
+// write "cnt" buffers, going on after partial writes
+int writeAll(int fd, struct iovec *iov, int cnt)
+{
+    while (cnt > 0)
+    {
+	ssize_t n = writev(fd, iov, cnt);
+	if (n == -1)
+	{
+	    if (errno == EINTR) { continue; }
+	    return -1;
+	}
+
+	while (cnt > 0 && (size_t)n >= iov->iov_len) // skip the buffers fully written
+	{
+	    n -= iov->iov_len;
+	    iov++;
+	    cnt--;
+	}
+	if (cnt > 0)
+	{
+	    iov->iov_base = (char *)iov->iov_base + n;
+	    iov->iov_len -= n;
+	}
+    }
+    return 0;
+}
+
+// newline offsets of a part of the mapped file, found by one thread
+struct indexChunk
+{
+    char *p;
+    size_t len;
+    size_t base;    // offset of "p" in the map
+    size_t *starts; // offset of the line after every '\n'
+    size_t n;
+    size_t cap;
+};
+
+void indexPush(struct indexChunk *c, size_t off)
+{
+    if (c->n == c->cap)
+    {
+	c->cap = c->cap ? c->cap * 2 : 4096;
+	c->starts = realloc(c->starts, sizeof(size_t) * c->cap);
+	if (c->starts == NULL) { die("realloc"); }
+    }
+    c->starts[c->n++] = off;
+}
+
+void indexScanTail(struct indexChunk *c, size_t i)
+{
+    for (; i < c->len; i++)
+    {
+	if (c->p[i] == '\n') { indexPush(c, c->base + i + 1); }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// compare 32 bytes at a time, every bit of the mask is a '\n'
+__attribute__((target("avx2")))
+void indexScanAVX2(struct indexChunk *c)
+{
+    __m256i nl = _mm256_set1_epi8('\n');
+    size_t i;
+    for (i = 0; i + 32 <= c->len; i += 32)
+    {
+	__m256i v = _mm256_loadu_si256((const __m256i *)(c->p + i));
+	unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+	while (mask)
+	{
+	    indexPush(c, c->base + i + __builtin_ctz(mask) + 1);
+	    mask &= mask - 1;
+	}
+    }
+    indexScanTail(c, i);
+}
+
+__attribute__((target("sse2")))
+void indexScanSSE2(struct indexChunk *c)
+{
+    __m128i nl = _mm_set1_epi8('\n');
+    size_t i;
+    for (i = 0; i + 16 <= c->len; i += 16)
+    {
+	__m128i v = _mm_loadu_si128((const __m128i *)(c->p + i));
+	unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+	while (mask)
+	{
+	    indexPush(c, c->base + i + __builtin_ctz(mask) + 1);
+	    mask &= mask - 1;
+	}
+    }
+    indexScanTail(c, i);
+}
+#endif
+
+void *indexScan(void *arg)
+{
+    struct indexChunk *c = arg;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) { indexScanAVX2(c); }
+    else { indexScanSSE2(c); }
+#else
+    char *p = c->p;
+    char *end = c->p + c->len;
+    while ((p = memchr(p, '\n', end - p)) != NULL)
+    {
+	p++;
+	indexPush(c, c->base + (p - c->p));
+    }
+#endif
+    return NULL;
+}
+
+void editorOpenMapped(char *map, size_t size)
+{
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    // split the file in chunks scanned in parallel, then join the offsets in order
+    struct indexChunk chunks[KILO_INDEX_THREADS];
+    pthread_t threads[KILO_INDEX_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nchunks = size / KILO_INDEX_CHUNK + 1;
+    if (nchunks > cpus) { nchunks = cpus; }
+    if (nchunks > KILO_INDEX_THREADS) { nchunks = KILO_INDEX_THREADS; }
+    if (nchunks < 1) { nchunks = 1; }
+
+    int j;
+    for (j = 0; j < nchunks; j++)
+    {
+	size_t from = size / nchunks * j;
+	size_t to = (j == nchunks - 1) ? size : size / nchunks * (j + 1);
+	chunks[j].p = map + from;
+	chunks[j].len = to - from;
+	chunks[j].base = from;
+	chunks[j].starts = NULL;
+	chunks[j].n = chunks[j].cap = 0;
+    }
+    for (j = 1; j < nchunks; j++)
+    {
+	if (pthread_create(&threads[j], NULL, indexScan, &chunks[j]) != 0) { die("pthread_create"); }
+    }
+    indexScan(&chunks[0]);
+    for (j = 1; j < nchunks; j++) { pthread_join(threads[j], NULL); }
+
+    size_t n = 0;
+    for (j = 0; j < nchunks; j++) { n += chunks[j].n; }
+
+    size_t *index = malloc(sizeof(size_t) * (n + 2));
+    if (index == NULL) { die("malloc"); }
+    index[0] = 0;
+    n = 1;
+    for (j = 0; j < nchunks; j++)
+    {
+	if (chunks[j].n) { memcpy(&index[n], chunks[j].starts, sizeof(size_t) * chunks[j].n); }
+	n += chunks[j].n;
+	free(chunks[j].starts);
+    }
+    // after the last '\n' there is no line, else the last line has no '\n': as if it had one
+    if (index[n - 1] == size) { n--; }
+    else { index[n] = size + 1; }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    if (size >= KILO_INDEX_CHUNK) // small files keep the help message
+	editorSetStatusMessage("%zu lines indexed in %.1f ms (%.2f GB/s, %d threads)", 
+		n, secs * 1e3, secs > 0 ? size / secs / 1e9 : 0.0, nchunks);
+
+    E.map = map;
+    E.mapSize = size;
+    E.lineIndex = index;
+    E.rowTree = blockNewMapped(0, n);
+    E.numTextRows = n;
+    E.dirty = 0;
+}
+
+void editorOpen(char *filename)
+{
+    free(E.filename);
+    E.filename = strdup(filename); 
+    //makes a copy of the string, allocating the memory and assuming you will free() that memory.
+
+    editorSelectSyntaxHighlight();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) { die("open"); }
+
+    // regular files are mapped: only the offsets of the lines are read now, 
+    // rows are created when displayed or edited
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map != MAP_FAILED)
+	{
+	    close(fd);
+	    editorOpenMapped(map, st.st_size);
+	    return;
+	}
+    }
+
+    FILE *fp = fdopen(fd, "r");
+    if (!fp) { die("fdopen"); }
+
+    char *line = NULL;
+    size_t linecap = 0; // buffer size (pointed to &line)
+    ssize_t linelen;    // n° of chars readed
+
+    // getline() return -1 when there's no more lines to read
+    E.undoLock++; // the file as read is not an edit
+    while ((linelen = getline(&line, &linecap, fp)) != -1) // getline() allocs memory needed
+    {
+	while (linelen > 0 && ( line[linelen -1] == '\n' || line[linelen -1] == '\r' ))
+	    linelen--; // remove "\n", "\r"
+
+	editorInsertRow(E.numTextRows ,line, linelen);
+    }
+    E.undoLock--;
+    free(line);
+    fclose(fp);
+    E.dirty = 0; //cause called editorInsertRow()
+}
+
+// generation of the oldest snapshot still read by a thread ( 0 = none )
+unsigned int editorSnapshotOldest()
+{
+    unsigned int gen = 0;
+    if (E.save) { gen = E.save->gen; }
+    if (E.hlJob && (gen == 0 || E.hlJob->gen < gen)) { gen = E.hlJob->gen; }
+    return gen;
+}
+
+// rows changed while a snapshot of them is read by a thread ( save or highlighter ) get their own 
+// copy of chars first: the thread still reads the old ones ( freed when it's over )
+void editorRowDetach(erow *row)
+{
+    unsigned int oldest = editorSnapshotOldest();
+    if (oldest == 0 || row->snapGen < oldest) { return; }
+
+    if (E.nkept == E.keptCap)
+    {
+	E.keptCap = E.keptCap ? E.keptCap * 2 : 64;
+	E.kept = realloc(E.kept, E.keptCap * sizeof(struct keptChars));
+	if (E.kept == NULL) { die("realloc"); }
+    }
+    E.kept[E.nkept].chars = row->chars;
+    E.kept[E.nkept].size = row->size + 1;
+    E.kept[E.nkept++].gen = row->snapGen;
+
+    char *chars = rowAlloc(row->size + 1);
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    row->chars = chars;
+    row->snapGen = 0;
+}
+
+// a snapshot is over: free the old chars no other snapshot can read
+void editorKeptFree()
+{
+    unsigned int oldest = editorSnapshotOldest();
+    int n = 0;
+    for (int j = 0; j < E.nkept; j++)
+    {
+	if (oldest && E.kept[j].gen >= oldest) { E.kept[n++] = E.kept[j]; }
+	else { rowFree(E.kept[j].chars, E.kept[j].size); }
+    }
+    E.nkept = n;
+}
+
+// the rows [from, to) as they are now: mapped lines are referenced by their n°, loaded rows share 
+// their chars ( tagged with a new generation, see editorRowDetach() ). Returns the n° of segments
+int editorSnapshot(int from, int to, struct saveSeg **segs)
+{
+    struct rowBlock *b;
+    int off;
+    int n = 0;
+    int at = from;
+    for (b = blockFind(from, &off); b && at < to; at += b->nrows - off, b = blockNext(b), off = 0) { n++; }
+    *segs = malloc((n ? n : 1) * sizeof(struct saveSeg));
+    if (*segs == NULL) { die("malloc"); }
+
+    E.snapGen++;
+    n = 0;
+    for (b = blockFind(from, &off); b && from < to; b = blockNext(b), off = 0, n++)
+    {
+	struct saveSeg *seg = &(*segs)[n];
+	seg->mapFirst = b->mapFirst + off;
+	seg->nrows = b->nrows - off;
+	if (seg->nrows > to - from) { seg->nrows = to - from; }
+	seg->lines = NULL;
+	from += seg->nrows;
+	if (b->rows == NULL) { continue; }
+
+	seg->lines = malloc((seg->nrows ? seg->nrows : 1) * sizeof(struct iovec));
+	if (seg->lines == NULL) { die("malloc"); }
+	for (int j = 0; j < seg->nrows; j++)
+	{
+	    erow *row = &b->rows[off + j];
+	    seg->lines[j].iov_base = row->chars;
+	    seg->lines[j].iov_len = row->size;
+	    row->snapGen = E.snapGen;
+	}
+    }
+    return n;
+}
+
+// stream the snapshot to fd, KILO_SAVE_IOV buffers for each writev(): memory used doesn't depend on the file size
+int editorWriteSnapshot(int fd, struct saveJob *job)
+{
+    struct iovec iov[KILO_SAVE_IOV];
+    int cnt = 0;
+    int done = 0;
+    int pct = 0;
+
+    for (int n = 0; n < job->nsegs; n++)
+    {
+	struct saveSeg *seg = &job->segs[n];
+	for (int j = 0; j < seg->nrows; j++)
+	{
+	    if (seg->lines) { iov[cnt] = seg->lines[j]; }
+	    else // still in the mapped file
+	    { 
+		size_t len;
+		iov[cnt].iov_base = editorMappedLine(seg->mapFirst + j, &len);
+		iov[cnt].iov_len = len;
+	    }
+	    iov[cnt + 1].iov_base = "\n"; // '\n' at end of each line
+	    iov[cnt + 1].iov_len = 1;
+	    job->written += iov[cnt].iov_len + 1;
+	    cnt += 2;
+
+	    if (cnt == KILO_SAVE_IOV)
+	    {
+		if (writeAll(fd, iov, cnt) == -1) { return -1; }
+		cnt = 0;
+
+		// progress: the main thread is woken up for every 1%
+		done += KILO_SAVE_IOV / 2;
+		__atomic_store_n(&job->rowsDone, done, __ATOMIC_RELAXED);
+		if (done * 100LL / job->nrows != pct)
+		{
+		    pct = done * 100LL / job->nrows;
+		    write(job->wake[1], "p", 1);
+		}
+	    }
+	}
+    }
+    return writeAll(fd, iov, cnt);
+}
+
+// the rename is on disk once its directory is too
+int editorSyncDir(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash == path ? 1 : (size_t)(slash - path)) : strdup(".");
+    if (dir == NULL) { errno = ENOMEM; return -1; }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    free(dir);
+    if (fd == -1) { return -1; }
+
+    int r = fsync(fd);
+    int err = errno;
+    if (r == -1 && err == EINVAL) { r = 0; } // file systems that can't sync a directory
+    close(fd);
+    errno = err;
+    return r;
+}
+
+// writer thread: a crash leaves the old file intact, and the mapped rows still point to the old content.
+// In place ( no temp file ) the mapped lines were copied out first by editorMapDetach()
+void *editorSaveThread(void *arg)
+{
+    struct saveJob *job = arg;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    job->err = 0;
+    if (editorWriteSnapshot(job->fd, job) == -1 || 
+	(job->tmp == NULL && ftruncate(job->fd, job->written) == -1) || // cut the old tail
+	fsync(job->fd) == -1) 
+    {
+	job->err = errno;
+	close(job->fd);
+    }
+    else if (close(job->fd) == -1) { job->err = errno; }
+    else if (job->tmp && rename(job->tmp, job->filename) == -1) { job->err = errno; }
+    else if (job->tmp && editorSyncDir(job->filename) == -1) { job->err = errno; }
+
+    if (job->err && job->tmp) { unlink(job->tmp); }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    job->secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+    write(job->wake[1], "d", 1);
+    return NULL;
+}
+
+// called by the main thread when the writer wakes it up ( or to wait for the end of the save )
+void editorSaveCheck(int wait)
+{
+    struct saveJob *job = E.save;
+    if (job == NULL) { return; }
+
+    char drain[64];
+    while (read(job->wake[0], drain, sizeof(drain)) > 0) {}
+    E.saveEvent = 0;
+
+    if (!wait && !__atomic_load_n(&job->done, __ATOMIC_ACQUIRE))
+    {
+	editorSetStatusMessage("Saving... %d%%", 
+		(int)(__atomic_load_n(&job->rowsDone, __ATOMIC_RELAXED) * 100LL / job->nrows));
+	return;
+    }
+
+    if (job->threaded) { pthread_join(job->thread, NULL); }
+    if (job->err == 0)
+    {
+	E.undoSaved = job->undoPos;
+	E.dirty = E.undoPos != E.undoSaved; // edits made during the save are still to be saved
+	if (job->written >= KILO_INDEX_CHUNK)
+	    editorSetStatusMessage("%zu bytes written to disk (%.1f MB/s)", 
+		    job->written, job->secs > 0 ? job->written / job->secs / 1e6 : 0.0);
+	else
+	    editorSetStatusMessage("%zu bytes written to disk", job->written);
+    }
+    else 
+    {
+	editorSetStatusMessage("Can't save! I/O error: %s", strerror(job->err));
+    }
+
+    for (int n = 0; n < job->nsegs; n++) { free(job->segs[n].lines); }
+    free(job->segs);
+    free(job->filename);
+    free(job->tmp);
+    close(job->wake[0]);
+    close(job->wake[1]);
+    free(job);
+    E.save = NULL;
+    editorKeptFree();
+}
+
+// the file is about to be rewritten in place: the lines not loaded yet are copied out of the
+// mapping first, the highlighter worker reading it is stopped ( search workers live only in the prompt )
+int editorMapDetach()
+{
+    if (E.map == NULL) { return 0; }
+    char *copy = malloc(E.mapSize);
+    if (copy == NULL) { return -1; }
+
+    editorSyntaxJobStop();
+    memcpy(copy, E.map, E.mapSize);
+    munmap(E.map, E.mapSize);
+    E.map = copy;
+    return 0;
+}
+
+// open the file the writer writes to: a temp file next to the target, with its mode and owner, renamed 
+// over it at the end. Files with hard links, or in a directory where the temp file can't be created, 
+// are written in place instead
+int editorSaveOpen(struct saveJob *job)
+{
+    char *path = realpath(job->filename, NULL); // a symlink stays a symlink ( a new file isn't resolved )
+    if (path)
+    {
+	free(job->filename);
+	job->filename = path;
+    }
+
+    struct stat st;
+    int exists = stat(job->filename, &st) == 0;
+    job->fd = -1;
+    if (!exists || st.st_nlink == 1)
+    {
+	size_t nameLen = strlen(job->filename) + 8;
+	job->tmp = malloc(nameLen);
+	if (job->tmp == NULL) { die("malloc"); }
+	snprintf(job->tmp, nameLen, "%s.XXXXXX", job->filename);
+	job->fd = mkstemp(job->tmp);
+
+	// 0644 = standard permission for text files( Owner permission read/write, others read only).
+	// The owner first: chown() clears the set-user-ID bits
+	int err = errno;
+	if (job->fd != -1 && 
+	    ((exists && fchown(job->fd, st.st_uid, st.st_gid) == -1 && errno != EPERM) ||
+	     fchmod(job->fd, exists ? (st.st_mode & 07777) : 0644) == -1))
+	{
+	    err = errno;
+	    close(job->fd);
+	    unlink(job->tmp);
+	    job->fd = -1;
+	}
+	if (job->fd == -1)
+	{
+	    free(job->tmp);
+	    job->tmp = NULL;
+	    errno = err;
+	    if (err != EACCES && err != EROFS) { return -1; }
+	}
+    }
+
+    if (job->fd == -1) // in place
+    {
+	job->fd = open(job->filename, O_WRONLY | O_CREAT, 0644);
+	if (job->fd == -1) { return -1; }
+	if (editorMapDetach() == -1)
+	{
+	    close(job->fd);
+	    errno = ENOMEM;
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+void editorSave()
+{
+    if (E.save) 
+    { 
+	editorSetStatusMessage("Save already in progress");
+	return; 
+    }
+
+    if (E.filename == NULL) 
+    { 
+	E.filename = editorPrompt("Save as: %s  (ESC to cancel)", NULL);
+	if (E.filename == NULL)
+	{
+	    editorSetStatusMessage("Not saved");
+	    return;
+	}
+
+	editorSelectSyntaxHighlight();
+    }
+
+    struct saveJob *job = calloc(1, sizeof(struct saveJob));
+    if (job == NULL) { die("calloc"); }
+    if (pipe(job->wake) == -1)
+    {
+	free(job);
+	editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+	return;
+    }
+    fcntl(job->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(job->wake[1], F_SETFL, O_NONBLOCK);
+
+    job->filename = strdup(E.filename);
+    if (job->filename == NULL) { die("strdup"); }
+    if (editorSaveOpen(job) == -1)
+    {
+	editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+	free(job->filename);
+	close(job->wake[0]);
+	close(job->wake[1]);
+	free(job);
+	return;
+    }
+    editorUndoBreak(); // edits after the snapshot are a new group: another journal position
+    job->undoPos = E.undoPos;
+    job->nrows = E.numTextRows;
+    job->nsegs = editorSnapshot(0, E.numTextRows, &job->segs);
+    job->gen = E.snapGen;
+    E.save = job;
+
+    job->threaded = pthread_create(&job->thread, NULL, editorSaveThread, job) == 0;
+    if (!job->threaded) 
+    { 
+	editorSaveThread(job); 
+	editorSaveCheck(1);
+    }
+}
+
+
+/*************************************************************************/
+/********* Regex *********************************************************/
+// syntax: . [] [^] * + ? | () ^ $ and \d \w \s \t \<char>. The regex is compiled in two NFAs,
+// run as lazy DFAs: matching is linear in the length of the line, no backtracking
+#define RE_AT_START 1
+#define RE_AT_END 2
+#define RE_MATCH 1
+#define RE_MATCH_END 2 // match if the text ends here ( $ )
+#define RE_DEAD 4      // no NFA state left
+
+void reSetAdd(unsigned char *set, int c)
+{
+    set[c >> 3] |= 1 << (c & 7);
+}
+
+int reSetHas(const unsigned char *set, int c)
+{
+    return set[c >> 3] & (1 << (c & 7));
+}
+
+int reNewNode(struct regex *re, int op, int a, int b)
+{
+    if (re->nnodes == re->cap)
+    {
+	re->cap = re->cap ? re->cap * 2 : 32;
+	re->node = realloc(re->node, re->cap * sizeof(struct reNode));
+	if (re->node == NULL) { die("realloc"); }
+    }
+    struct reNode *n = &re->node[re->nnodes];
+    n->op = op;
+    n->a = a;
+    n->b = b;
+    memset(n->set, 0, sizeof(n->set));
+    return re->nnodes++;
+}
+
+// \d \w \s \t, or the char itself
+void reEscape(unsigned char *set, int c)
+{
+    int j;
+    switch (c)
+    {
+	case 'd': for (j = '0'; j <= '9'; j++) { reSetAdd(set, j); } break;
+	case 'w': for (j = 0; j < 256; j++) { if (isalnum(j) || j == '_') reSetAdd(set, j); } break;
+	case 's': for (j = 0; j < 256; j++) { if (isspace(j)) reSetAdd(set, j); } break;
+	case 't': reSetAdd(set, '\t'); break;
+	default: reSetAdd(set, c); break;
+    }
+}
+
+int reParseAlt(struct regex *re);
+
+int reParseClass(struct regex *re)
+{
+    int n = reNewNode(re, RE_SET, -1, -1);
+    unsigned char set[32] = { 0 };
+    int neg = (*re->p == '^');
+    if (neg) { re->p++; }
+
+    int first = 1; // "[]...]" : a ']' first is a char
+    while (*re->p && (*re->p != ']' || first))
+    {
+	int c = (unsigned char)*re->p++;
+	first = 0;
+	if (c == '\\' && *re->p) 
+	{ 
+	    reEscape(set, (unsigned char)*re->p++); 
+	}
+	else if (re->p[0] == '-' && re->p[1] && re->p[1] != ']') // range
+	{
+	    for (int j = c; j <= (unsigned char)re->p[1]; j++) { reSetAdd(set, j); }
+	    re->p += 2;
+	}
+	else 
+	{ 
+	    reSetAdd(set, c); 
+	}
+    }
+    if (*re->p == ']') { re->p++; }
+    else { re->err = 1; }
+
+    if (neg) { for (int j = 0; j < 32; j++) { set[j] = ~set[j]; } }
+    memcpy(re->node[n].set, set, sizeof(set));
+    return n;
+}
 
-    for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
+int reParseAtom(struct regex *re)
+{
+    int c = (unsigned char)*re->p++;
+    int n;
+    switch (c)
     {
-	struct editorSyntax *s = &HLDB[j];
-	unsigned int i = 0;
-	while (s->filematch[i])
-	{
-	    int is_ext = (s->filematch[i][0] == '.');
-	    if ( (is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-	    	(!is_ext && strstr(E.filename, s->filematch[i])) )
-	    {
-		E.syntax = s;
+	case '(':
+	    n = reParseAlt(re);
+	    if (*re->p == ')') { re->p++; }
+	    else { re->err = 1; }
+	    return n;
+	case '[': 
+	    return reParseClass(re);
+	case '^': 
+	    return reNewNode(re, RE_BOL, -1, -1);
+	case '$': 
+	    return reNewNode(re, RE_EOL, -1, -1);
+	case '.':
+	    n = reNewNode(re, RE_SET, -1, -1);
+	    memset(re->node[n].set, 0xff, sizeof(re->node[n].set));
+	    return n;
+	case '\\':
+	    n = reNewNode(re, RE_SET, -1, -1);
+	    if (*re->p == '\0') { re->err = 1; }
+	    else { reEscape(re->node[n].set, (unsigned char)*re->p++); }
+	    return n;
+	case '*': case '+': case '?': // nothing to repeat
+	    re->err = 1;
+	    return reNewNode(re, RE_EMPTY, -1, -1);
+	default:
+	    n = reNewNode(re, RE_SET, -1, -1);
+	    reSetAdd(re->node[n].set, c);
+	    return n;
+    }
+}
 
-		int filerow;
-		for (filerow = 0; filerow < E.numTextRows; filerow++)
-		    editorUpdateSyntax(&E.row[filerow]);
+int reParseRepeat(struct regex *re)
+{
+    int n = reParseAtom(re);
+    while (*re->p == '*' || *re->p == '+' || *re->p == '?')
+    {
+	int op = (*re->p == '*') ? RE_STAR : (*re->p == '+') ? RE_PLUS : RE_QUEST;
+	re->p++;
+	n = reNewNode(re, op, n, -1);
+    }
+    return n;
+}
 
-		return;
-	    }
-	    i++;
-	}
+int reParseCat(struct regex *re)
+{
+    int n = reNewNode(re, RE_EMPTY, -1, -1);
+    while (*re->p && *re->p != '|' && *re->p != ')')
+    {
+	int b = reParseRepeat(re);
+	n = reNewNode(re, RE_CAT, n, b);
     }
+    return n;
 }
 
+int reParseAlt(struct regex *re)
+{
+    int n = reParseCat(re);
+    while (*re->p == '|')
+    {
+	re->p++;
+	int b = reParseCat(re);
+	n = reNewNode(re, RE_ALT, n, b);
+    }
+    return n;
+}
 
-/*************************************************************************/
-/********* Row operation *************************************************/
-int editorRowCxToRx(erow *row, int cx)
+int reNewState(struct reNFA *nfa)
 {
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++)
+    if (nfa->n == nfa->cap)
     {
-	if (row->chars[j] == '\t')
-	    rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+	nfa->cap = nfa->cap ? nfa->cap * 2 : 64;
+	nfa->s = realloc(nfa->s, nfa->cap * sizeof(struct reState));
+	if (nfa->s == NULL) { die("realloc"); }
+    }
+    struct reState *st = &nfa->s[nfa->n];
+    memset(st->set, 0, sizeof(st->set));
+    st->out = -1;
+    st->eps[0] = st->eps[1] = -1;
+    st->assert = 0;
+    return nfa->n++;
+}
 
-	rx++;
+// Thompson construction of node n: *s = entry state, *e = exit state ( with no moves yet ). 
+// Reversed ( rev ): concatenations are swapped, ^ and $ too
+void reCompileNode(struct regex *re, struct reNFA *nfa, int n, int rev, int *s, int *e)
+{
+    struct reNode node = re->node[n];
+    int as, ae, bs, be;
+    switch (node.op)
+    {
+	case RE_SET:
+	    *s = reNewState(nfa);
+	    *e = reNewState(nfa);
+	    memcpy(nfa->s[*s].set, node.set, sizeof(node.set));
+	    nfa->s[*s].out = *e;
+	    break;
+	case RE_CAT:
+	    reCompileNode(re, nfa, rev ? node.b : node.a, rev, s, &ae);
+	    reCompileNode(re, nfa, rev ? node.a : node.b, rev, &bs, e);
+	    nfa->s[ae].eps[0] = bs;
+	    break;
+	case RE_ALT:
+	    reCompileNode(re, nfa, node.a, rev, &as, &ae);
+	    reCompileNode(re, nfa, node.b, rev, &bs, &be);
+	    *s = reNewState(nfa);
+	    *e = reNewState(nfa);
+	    nfa->s[*s].eps[0] = as;
+	    nfa->s[*s].eps[1] = bs;
+	    nfa->s[ae].eps[0] = *e;
+	    nfa->s[be].eps[0] = *e;
+	    break;
+	case RE_STAR:
+	case RE_QUEST:
+	    reCompileNode(re, nfa, node.a, rev, &as, &ae);
+	    *s = reNewState(nfa);
+	    *e = reNewState(nfa);
+	    nfa->s[*s].eps[0] = as;
+	    nfa->s[*s].eps[1] = *e;
+	    nfa->s[ae].eps[0] = (node.op == RE_STAR) ? as : *e;
+	    nfa->s[ae].eps[1] = (node.op == RE_STAR) ? *e : -1;
+	    break;
+	case RE_PLUS:
+	    reCompileNode(re, nfa, node.a, rev, s, &ae);
+	    *e = reNewState(nfa);
+	    nfa->s[ae].eps[0] = *s;
+	    nfa->s[ae].eps[1] = *e;
+	    break;
+	case RE_BOL:
+	case RE_EOL:
+	    *s = reNewState(nfa);
+	    *e = reNewState(nfa);
+	    nfa->s[*s].assert = ((node.op == RE_BOL) != rev) ? RE_AT_START : RE_AT_END;
+	    nfa->s[*s].eps[0] = *e;
+	    break;
+	default: // RE_EMPTY
+	    *s = *e = reNewState(nfa);
+	    break;
     }
+}
 
-    return rx;
+void reFree(struct regex *re)
+{
+    if (re == NULL) { return; }
+    free(re->node);
+    free(re->fwd.s);
+    free(re->rev.s);
+    free(re);
 }
 
-int editorRowRxToCx(erow *row, int rx)
+// the byte every match starts with, -1 if there are more or the match can be empty
+int reFirstByte(struct reNFA *nfa)
 {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++)
+    unsigned char set[32] = { 0 };
+    int *stack = malloc(nfa->n * sizeof(int));
+    char *seen = calloc(nfa->n, 1);
+    if (stack == NULL || seen == NULL) { die("malloc"); }
+    int top = 0;
+    int empty = 0;
+
+    stack[top++] = nfa->start;
+    seen[nfa->start] = 1;
+    while (top)
     {
-	if (row->chars[cx] == '\t')
-	    cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+	struct reState *st = &nfa->s[stack[--top]];
+	if (st == &nfa->s[nfa->match]) { empty = 1; }
+	for (int j = 0; j < 32; j++) { set[j] |= st->set[j]; }
+	for (int k = 0; k < 2; k++)
+	{
+	    int e = st->eps[k];
+	    if (e >= 0 && !seen[e]) 
+	    { 
+		seen[e] = 1; 
+		stack[top++] = e; 
+	    }
+	}
+    }
+    free(stack);
+    free(seen);
 
-	cur_rx++;
-	if (cur_rx > rx) { return cx; }
+    int first = -1;
+    for (int c = 0; c < 256; c++)
+    {
+	if (!reSetHas(set, c)) { continue; }
+	if (first != -1) { return -1; }
+	first = c;
     }
-    return cx;
+    return empty ? -1 : first;
 }
 
-void editorUpdateRow(erow *row) // from chars to render (proper content VS render mode)
+// NULL if the regex is not valid
+struct regex *reCompile(const char *query)
 {
-    int tabs = 0;
-    int j;
-    for (j = 0; j < row->size; j++)
+    struct regex *re = calloc(1, sizeof(struct regex));
+    if (re == NULL) { die("calloc"); }
+    re->p = query;
+    int root = reParseAlt(re);
+    if (*re->p != '\0') { re->err = 1; } // unmatched ')'
+    if (re->err)
     {
-	if (row->chars[j] == '\t') { tabs++; }
+	reFree(re);
+	return NULL;
     }
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(KILO_TAB_STOP -1) + 1);
+    reCompileNode(re, &re->fwd, root, 0, &re->fwd.start, &re->fwd.match);
+    reCompileNode(re, &re->rev, root, 1, &re->rev.start, &re->rev.match);
+    re->firstByte = reFirstByte(&re->fwd);
+    return re;
+}
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++)
+void reDFAReset(struct reDFA *d)
+{
+    d->nstates = 0;
+    d->setsLen = 0;
+    d->start[0] = d->start[1] = -1;
+    memset(d->hash, 0, 2 * RE_DFA_STATES * sizeof(int));
+}
+
+int reClosure(struct reDFA *d, int *in, int n, int at, int *out);
+
+void reDFAInit(struct reDFA *d, struct reNFA *nfa, int unanchored)
+{
+    d->nfa = nfa;
+    d->unanchored = unanchored;
+    d->next = malloc(RE_DFA_STATES * 256 * sizeof(int));
+    d->flags = malloc(RE_DFA_STATES);
+    d->setStart = malloc(RE_DFA_STATES * sizeof(int));
+    d->setLen = malloc(RE_DFA_STATES * sizeof(int));
+    d->setsCap = 256;
+    d->sets = malloc(d->setsCap * sizeof(int));
+    d->hash = malloc(2 * RE_DFA_STATES * sizeof(int));
+    d->in = malloc((2 * nfa->n + 1) * sizeof(int));
+    d->out = malloc(nfa->n * sizeof(int));
+    d->tmp = malloc(nfa->n * sizeof(int));
+    d->stack = malloc((nfa->n + 1) * sizeof(int));
+    d->mark = calloc(nfa->n, sizeof(int));
+    d->startSet = malloc((nfa->n + 1) * sizeof(int));
+    if (d->next == NULL || d->flags == NULL || d->setStart == NULL || d->setLen == NULL || 
+	d->sets == NULL || d->hash == NULL || d->in == NULL || d->out == NULL || d->tmp == NULL || 
+	d->stack == NULL || d->mark == NULL || d->startSet == NULL) { die("malloc"); }
+    d->gen = 0;
+    d->startLen = 0;
+    if (unanchored)
     {
-	if (row->chars[j] == '\t')
-	{
-	    row->render[idx++] = ' ';
-	    while (idx % KILO_TAB_STOP != 0)
-		row->render[idx++] = ' ';
-	}
-	else 
-	{
-	    // copy row->chars in row->render
-	    row->render[idx++] = row->chars[j];
-	}
+	d->in[0] = nfa->start;
+	d->startLen = reClosure(d, d->in, 1, 0, d->startSet);
     }
+    reDFAReset(d);
+}
 
-    row->render[idx] = '\0';
-    row->rendersize = idx;
+void reDFAFree(struct reDFA *d)
+{
+    free(d->next);
+    free(d->flags);
+    free(d->setStart);
+    free(d->setLen);
+    free(d->sets);
+    free(d->hash);
+    free(d->in);
+    free(d->out);
+    free(d->tmp);
+    free(d->stack);
+    free(d->mark);
+    free(d->startSet);
+}
 
-    editorUpdateSyntax(row);
+int reCmpInt(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
 }
 
-void editorInsertRow(int at, char *s, size_t len)
+// epsilon closure of the n states of "in" ( sorted in "out" ): kept only the states that move 
+// on a byte, the match and $ not resolved yet
+int reClosure(struct reDFA *d, int *in, int n, int at, int *out)
 {
-    if (at < 0 || at > E.numTextRows) { return; }
+    struct reNFA *nfa = d->nfa;
+    int top = 0, len = 0;
+    d->gen++;
+    for (int j = 0; j < n; j++)
+    {
+	if (d->mark[in[j]] == d->gen) { continue; }
+	d->mark[in[j]] = d->gen;
+	d->stack[top++] = in[j];
+    }
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numTextRows + 1)); //add 1 line space
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numTextRows - at));
+    while (top)
+    {
+	int i = d->stack[--top];
+	struct reState *st = &nfa->s[i];
+	if (st->out >= 0 || i == nfa->match || (st->assert == RE_AT_END && !(at & RE_AT_END))) { out[len++] = i; }
+	if (st->assert && !(at & st->assert)) { continue; }
 
-    for (int j = at + 1; j <= E.numTextRows; j++) { E.row[j].idx++; }
-    E.row[at].idx = at;
+	for (int k = 0; k < 2; k++)
+	{
+	    int e = st->eps[k];
+	    if (e < 0 || d->mark[e] == d->gen) { continue; }
+	    d->mark[e] = d->gen;
+	    d->stack[top++] = e;
+	}
+    }
+    qsort(out, len, sizeof(int), reCmpInt);
+    return len;
+}
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+// DFA state of a set of NFA states, -1 when the cache is full
+int reIntern(struct reDFA *d, int *set, int len)
+{
+    unsigned int h = 2166136261u;
+    for (int j = 0; j < len; j++) { h = (h ^ set[j]) * 16777619u; }
+    h &= 2 * RE_DFA_STATES - 1;
 
-    E.row[at].rendersize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
+    while (d->hash[h])
+    {
+	int id = d->hash[h] - 1;
+	if (d->setLen[id] == len && !memcmp(&d->sets[d->setStart[id]], set, len * sizeof(int))) { return id; }
+	h = (h + 1) & (2 * RE_DFA_STATES - 1);
+    }
+    if (d->nstates == RE_DFA_STATES) { return -1; }
 
-    E.numTextRows++;
-    E.dirty++;
+    int id = d->nstates++;
+    if (d->setsLen + len > d->setsCap)
+    {
+	while (d->setsLen + len > d->setsCap) { d->setsCap *= 2; }
+	d->sets = realloc(d->sets, d->setsCap * sizeof(int));
+	if (d->sets == NULL) { die("realloc"); }
+    }
+    memcpy(&d->sets[d->setsLen], set, len * sizeof(int));
+    d->setStart[id] = d->setsLen;
+    d->setLen[id] = len;
+    d->setsLen += len;
+    memset(&d->next[id * 256], 0xff, 256 * sizeof(int));
+    d->hash[h] = id + 1;
+
+    d->flags[id] = len ? 0 : RE_DEAD;
+    memcpy(d->in, set, len * sizeof(int));
+    int n = reClosure(d, d->in, len, RE_AT_END, d->tmp);
+    for (int j = 0; j < n; j++)
+    {
+	if (d->tmp[j] != d->nfa->match) { continue; }
+	d->flags[id] |= RE_MATCH_END;
+	for (int k = 0; k < len; k++) { if (set[k] == d->nfa->match) d->flags[id] |= RE_MATCH; }
+    }
+    return id;
 }
 
-void editorFreeRow(erow *row)
+// intern, starting again with an empty cache when it's full
+int reInternFlush(struct reDFA *d, int *set, int len)
 {
-    // allocated with "malloc()"
-    free(row->render); 
-    free(row->chars);
-    free(row->hl);
+    int id = reIntern(d, set, len);
+    if (id == -1)
+    {
+	reDFAReset(d);
+	id = reIntern(d, set, len);
+    }
+    return id;
 }
 
-void editorDeleteRow(int at)
+int reStart(struct reDFA *d, int atStart)
 {
-    if (at < 0 || at >= E.numTextRows) { return; }
+    if (d->start[atStart] >= 0) { return d->start[atStart]; }
 
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numTextRows -at - 1));
-    for (int j = at; j < E.numTextRows -1; j++) { E.row[j].idx--; }
-    E.numTextRows--;
-    E.dirty++;
+    d->in[0] = d->nfa->start;
+    int len = reClosure(d, d->in, 1, atStart ? RE_AT_START : 0, d->out);
+    int id = reInternFlush(d, d->out, len);
+    d->start[atStart] = id;
+    return id;
 }
 
-// for when Delete at the begin of line: append the content of current line to the previous line + remove the current line
-void editorRowAppendString(erow *row, char *s, size_t len)
+// transition not built yet
+int reStep(struct reDFA *d, int id, int c)
 {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len); // copy to end of line
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+    struct reNFA *nfa = d->nfa;
+    int *set = &d->sets[d->setStart[id]];
+    int n = 0;
+    for (int j = 0; j < d->setLen[id]; j++)
+    {
+	struct reState *st = &nfa->s[set[j]];
+	if (st->out >= 0 && reSetHas(st->set, c)) { d->in[n++] = st->out; }
+    }
+    for (int j = 0; j < d->startLen; j++) // a match can start here too ( then it's not empty )
+    {
+	struct reState *st = &nfa->s[d->startSet[j]];
+	if (st->out >= 0 && reSetHas(st->set, c)) { d->in[n++] = st->out; }
+    }
+
+    int len = reClosure(d, d->in, n, 0, d->out);
+    int to = reIntern(d, d->out, len);
+    if (to == -1) // cache full: "id" is gone too
+    {
+	reDFAReset(d);
+	return reIntern(d, d->out, len);
+    }
+    d->next[id * 256 + c] = to;
+    return to;
 }
 
-void editorRowInsertChar(erow *row, int at, int c)
+void reMatcherInit(struct reMatcher *m, struct regex *re)
 {
-    if (at < 0 || at > row->size) { at = row->size; }
-    row->chars = realloc(row->chars, row->size + 2);
+    m->re = re;
+    m->starts = NULL;
+    m->startsCap = 0;
+    reDFAInit(&m->fwd, &re->fwd, 0);
+    reDFAInit(&m->rev, &re->rev, 1);
+}
 
-    // "memmove" is like "memcpy" but safer if src and dest overlap
-    // copy from [at] to end, and move by 1 (shift by 1)
-    memmove(&row->chars[at+1], &row->chars[at], row->size - at + 1);//(+1 is the [at] itself) row->size - at = from at+1 to end)  
-    row->size++;
-    row->chars[at] = c; // now at [at] insert c
-    editorUpdateRow(row);
-    E.dirty++;
+void reMatcherFree(struct reMatcher *m)
+{
+    reDFAFree(&m->fwd);
+    reDFAFree(&m->rev);
+    free(m->starts);
 }
 
-void editorRowDeleteChar(erow *row, int at)
+// positions of the line where a non-empty match can start ( bits of m->starts ): a single pass 
+// of the reversed regex from the end of the line back to the start. 0 if there are none
+int reStarts(struct reMatcher *m, const char *s, int len)
 {
-    if (at < 0 || at >= row->size) { return; }
+    int words = len / 64 + 1;
+    if (words > m->startsCap)
+    {
+	m->startsCap = words * 2;
+	m->starts = realloc(m->starts, m->startsCap * sizeof(unsigned long long));
+	if (m->starts == NULL) { die("realloc"); }
+    }
+    memset(m->starts, 0, words * sizeof(unsigned long long));
 
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+    struct reDFA *d = &m->rev;
+    int st = reStart(d, 1); // the end of the line
+    int found = 0;
+    for (int i = len - 1; i >= 0; i--)
+    {
+	int c = (unsigned char)s[i];
+	int nx = d->next[st * 256 + c];
+	st = (nx >= 0) ? nx : reStep(d, st, c);
+	if (d->flags[st] & RE_MATCH) 
+	{ 
+	    m->starts[i >> 6] |= 1ull << (i & 63); 
+	    found = 1; 
+	}
+    }
+    if (len && (d->flags[st] & RE_MATCH_END)) // ^
+    {
+	m->starts[0] |= 1; 
+	found = 1; 
+    }
+    return found;
 }
 
-/*************************************************************************/
-/********* Editor operations *********************************************/
-void editorInsertChar(int c)
+// first position where a match can start at "from" or after, -1 if none
+int reNextStart(struct reMatcher *m, int from, int len)
 {
-    if (E.cy == E.numTextRows) { editorInsertRow(E.numTextRows, "", 0); } // on ~ line
+    if (from > len) { return -1; }
 
-    editorRowInsertChar(&E.row[E.cy], E.cx, c); // insert char at cursor pos
-    E.cx++;
+    int w = from >> 6;
+    int words = len / 64 + 1;
+    unsigned long long bits = m->starts[w] & (~0ull << (from & 63));
+    while (bits == 0)
+    {
+	if (++w == words) { return -1; }
+	bits = m->starts[w];
+    }
+    return w * 64 + __builtin_ctzll(bits);
 }
 
-void editorDeleteChar()
+// end of the longest match starting at "from": the forward regex runs until it has no state 
+// left. -1 if no match
+int reLongest(struct reMatcher *m, const char *s, int len, int from)
 {
-    if (E.cy == E.numTextRows) { return; }
-    if (E.cx == 0 && E.cy == 0) { return; }
-
-    erow *row = &E.row[E.cy];
-    if (E.cx  > 0)
+    struct reDFA *d = &m->fwd;
+    int st = reStart(d, from == 0);
+    int e = -1;
+    int i = from;
+    while (1)
     {
-	editorRowDeleteChar(row, E.cx - 1);
-	E.cx--;
+	if (d->flags[st] & RE_MATCH) { e = i; }
+	if (i == len)
+	{
+	    if (d->flags[st] & RE_MATCH_END) { e = len; } // $
+	    break;
+	}
+	if (d->flags[st] & RE_DEAD) { break; }
+
+	int c = (unsigned char)s[i++];
+	int nx = d->next[st * 256 + c];
+	st = (nx >= 0) ? nx : reStep(d, st, c);
     }
-    else 
+    return e;
+}
+
+
+/*************************************************************************/
+/********* Find *********************************************************/
+// next occurrence of q in [p, end): memchr() on the first byte, then the rest is compared
+const char *findNext(const char *p, const char *end, const char *q, int qlen)
+{
+    while (end - p >= qlen)
     {
-	E.cx = E.row[E.cy - 1].size;
-	editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-	editorDeleteRow(E.cy);
-	E.cy--;
+	p = memchr(p, q[0], end - p - qlen + 1);
+	if (p == NULL) { return NULL; }
+	if (!memcmp(p + 1, q + 1, qlen - 1)) { return p; }
+	p++;
     }
+    return NULL;
 }
 
-void editorInsertNewLine()
+void findPush(struct findList *l, int row, int col, int len)
 {
-    if (E.cx == 0)
+    if (l->n == l->cap)
     {
-	editorInsertRow(E.cy, "", 0);
+	l->cap = l->cap ? l->cap * 2 : 256;
+	l->m = realloc(l->m, l->cap * sizeof(struct findMatch));
+	if (l->m == NULL) { die("realloc"); }
     }
-    else 
+    l->m[l->n].row = row;
+    l->m[l->n].col = col;
+    l->m[l->n].len = len;
+    l->n++;
+}
+
+// leftmost-longest regex matches of a line, one after the other: the positions where one can 
+// start come from a single backward pass, the ends from forward runs. Empty matches are skipped
+void findScanRegex(struct findList *l, struct reMatcher *m, int row, const char *s, int len)
+{
+    if (m->re->firstByte >= 0 && !memchr(s, m->re->firstByte, len)) { return; } // can't match here
+    if (!reStarts(m, s, len)) { return; }
+
+    int at = reNextStart(m, 0, len);
+    while (at >= 0)
     {
-	erow *row = &E.row[E.cy];
-	// insert new row from current row[cursor pos] to end row (in the next line) 
-	editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx); //new row
-	
-	// stop current row at cursor pos
-	row = &E.row[E.cy];
-	row->size = E.cx;
-	row->chars[row->size] = '\0';
-	editorUpdateRow(row);
+	int end = reLongest(m, s, len, at);
+	if (end > at) { findPush(l, row, at, end - at); } // ( an empty one only if a longer can't be )
+	at = reNextStart(m, end > at ? end : at + 1, len);
     }
-    E.cy++;
-    E.cx = 0;
 }
 
+// every occurrence of q ( overlapping too ) in "nrows" loaded rows, or the regex matches ( m )
+void findScanRows(struct findList *l, const char *q, int qlen, struct reMatcher *m, erow *rows, int at, int nrows)
+{
+    for (int j = 0; j < nrows; j++)
+    {
+	if (m) 
+	{ 
+	    findScanRegex(l, m, at + j, rows[j].chars, rows[j].size);
+	    continue;
+	}
 
-/*************************************************************************/
-/********* File I/O ******************************************************/
-char *editorRowsToString(int *bufLen)
+	const char *s = rows[j].chars;
+	const char *end = s + rows[j].size;
+	const char *p = s;
+	while ((p = findNext(p, end, q, qlen)) != NULL)
+	{
+	    findPush(l, at + j, p - s, qlen);
+	    p++;
+	}
+    }
+}
+
+// mapped lines are contiguous in the map: scanned in one go, the line comes from the index 
+// ( the query has no '\n' so a match never spans two lines )
+void findScanMapped(struct findList *l, const char *q, int qlen, struct reMatcher *m, int mapFirst, int at, int nrows)
 {
-    // total bytes to write to file
-    int totLen = 0;
-    int j;
-    for (j = 0; j < E.numTextRows; j++)
+    if (m && m->re->firstByte >= 0) // a regex is tried only on the lines with its first byte
+    {
+	int line = mapFirst;
+	const char *end = E.map + E.lineIndex[mapFirst + nrows] - 1;
+	const char *p = E.map + E.lineIndex[line];
+	while (p < end && (p = memchr(p, m->re->firstByte, end - p)) != NULL)
+	{
+	    size_t off = p - E.map;
+	    while (E.lineIndex[line + 1] <= off) { line++; }
+
+	    size_t len;
+	    char *s = editorMappedLine(line, &len);
+	    findScanRegex(l, m, at + line - mapFirst, s, len);
+	    p = E.map + E.lineIndex[line + 1]; // next line
+	}
+	return;
+    }
+    if (m) // otherwise line by line
     {
-	totLen += E.row[j].size + 1; // + space for '\n'
+	for (int j = 0; j < nrows; j++)
+	{
+	    size_t len;
+	    char *s = editorMappedLine(mapFirst + j, &len);
+	    findScanRegex(l, m, at + j, s, len);
+	}
+	return;
     }
-    *bufLen = totLen;
 
-    // copy line by line
-    char *buf = malloc(totLen);
-    char *p = buf;
-    for (j = 0; j < E.numTextRows; j++)
+    int line = mapFirst;
+    const char *end = E.map + E.lineIndex[mapFirst + nrows] - 1;
+    const char *p = E.map + E.lineIndex[line];
+    while ((p = findNext(p, end, q, qlen)) != NULL)
     {
-	memcpy(p, E.row[j].chars, E.row[j].size);
-	p += E.row[j].size;
-	*p = '\n'; // '\n' at end of each line
+	size_t off = p - E.map;
+	while (E.lineIndex[line + 1] <= off) { line++; }
+	findPush(l, at + line - mapFirst, off - E.lineIndex[line], qlen);
 	p++;
     }
-
-    return buf;
-    // return lenght, and a pointer to buf 
 }
 
-void editorOpen(char *filename)
+// search on the UI thread ( small buffers )
+void findScan(struct findResults *f)
 {
-    free(E.filename);
-    E.filename = strdup(filename); 
-    //makes a copy of the string, allocating the memory and assuming you will free() that memory.
+    struct rowBlock *b;
+    struct reMatcher matcher;
+    struct reMatcher *m = NULL;
+    int at = 0;
 
-    editorSelectSyntaxHighlight();
+    if (f->re)
+    {
+	m = &matcher;
+	reMatcherInit(m, f->re);
+    }
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp) { die("fopen"); }
+    f->list.n = 0;
+    for (b = blockFirst(); b; at += b->nrows, b = blockNext(b))
+    {
+	if (b->rows) { findScanRows(&f->list, f->query, f->qlen, m, b->rows, at, b->nrows); }
+	else { findScanMapped(&f->list, f->query, f->qlen, m, b->mapFirst, at, b->nrows); }
+    }
+    if (m) { reMatcherFree(m); }
+}
 
-    char *line = NULL;
-    size_t linecap = 0; // buffer size (pointed to &line)
-    ssize_t linelen;    // n° of chars readed
+void *findWorker(void *arg)
+{
+    struct findJob *job = arg;
+    int step = job->nitems / 64 + 1;
+    struct reMatcher matcher; // DFAs of this thread
+    struct reMatcher *m = NULL;
+    int i;
 
-    // getline() return -1 when there's no more lines to read
-    while ((linelen = getline(&line, &linecap, fp)) != -1) // getline() allocs memory needed
+    if (job->re)
     {
-	while (linelen > 0 && ( line[linelen -1] == '\n' || line[linelen -1] == '\r' ))
-	    linelen--; // remove "\n", "\r"
+	m = &matcher;
+	reMatcherInit(m, job->re);
+    }
 
-	editorInsertRow(E.numTextRows ,line, linelen);
+    while (!__atomic_load_n(&job->cancel, __ATOMIC_RELAXED) && 
+	   (i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nitems)
+    {
+	struct findItem *it = &job->items[i];
+	if (it->rows) { findScanRows(&it->found, job->query, job->qlen, m, it->rows, it->at, it->nrows); }
+	else { findScanMapped(&it->found, job->query, job->qlen, m, it->mapFirst, it->at, it->nrows); }
+	__atomic_store_n(&it->done, 1, __ATOMIC_RELEASE);
+
+	// the UI is woken up for the first item, then every 1/64 of the work and at the end
+	int ndone = __atomic_add_fetch(&job->ndone, 1, __ATOMIC_RELAXED);
+	if (i == 0 || ndone % step == 0 || ndone == job->nitems) { write(job->wake[1], "f", 1); }
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0; //cause called editorInsertRow()
+    if (m) { reMatcherFree(m); }
+    return NULL;
 }
 
-void editorSave()
+void findAddItem(struct findJob *job, int *cap, int at, int nrows, int mapFirst, erow *rows)
 {
-    if (E.filename == NULL) 
-    { 
-	E.filename = editorPrompt("Save as: %s  (ESC to cancel)", NULL);
-	if (E.filename == NULL)
+    if (job->nitems == *cap)
+    {
+	*cap = *cap ? *cap * 2 : 256;
+	job->items = realloc(job->items, *cap * sizeof(struct findItem));
+	if (job->items == NULL) { die("realloc"); }
+    }
+    struct findItem *it = &job->items[job->nitems++];
+    memset(it, 0, sizeof(*it));
+    it->at = at;
+    it->nrows = nrows;
+    it->mapFirst = mapFirst;
+    it->rows = rows;
+}
+
+// start the workers: a block of loaded rows is an item, mapped blocks are cut in items of 
+// about KILO_FIND_CHUNK bytes. The tree isn't touched by the workers ( blocks loaded by 
+// the UI meanwhile keep their mapped lines )
+void findStart(struct findResults *f)
+{
+    struct findJob *job = calloc(1, sizeof(struct findJob));
+    if (job == NULL) { die("calloc"); }
+    if (pipe(job->wake) == -1)
+    {
+	free(job);
+	findScan(f);
+	return;
+    }
+    fcntl(job->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(job->wake[1], F_SETFL, O_NONBLOCK);
+    job->query = strdup(f->query);
+    if (job->query == NULL) { die("strdup"); }
+    job->qlen = f->qlen;
+    job->re = f->re;
+
+    struct rowBlock *b;
+    int cap = 0;
+    int at = 0;
+    for (b = blockFirst(); b; at += b->nrows, b = blockNext(b))
+    {
+	if (b->rows) 
+	{ 
+	    findAddItem(job, &cap, at, b->nrows, 0, b->rows); 
+	    continue; 
+	}
+
+	int line = b->mapFirst;
+	int last = b->mapFirst + b->nrows;
+	while (line < last)
 	{
-	    editorSetStatusMessage("Not saved");
-	    return;
+	    // first line past the chunk ( binary search in the index )
+	    size_t limit = E.lineIndex[line] + KILO_FIND_CHUNK;
+	    int lo = line + 1, hi = last;
+	    while (lo < hi)
+	    {
+		int mid = lo + (hi - lo) / 2;
+		if (E.lineIndex[mid] <= limit) { lo = mid + 1; }
+		else { hi = mid; }
+	    }
+	    findAddItem(job, &cap, at + line - b->mapFirst, lo - line, line, NULL);
+	    line = lo;
 	}
+    }
 
-	editorSelectSyntaxHighlight();
+    f->list.n = 0;
+    f->job = job;
+    for (int j = 0; j < KILO_INDEX_THREADS; j++)
+    {
+	if (pthread_create(&job->threads[j], NULL, findWorker, job) != 0) { break; }
+	job->nthreads++;
+    }
+    if (job->nthreads == 0) { findWorker(job); } // no threads: all on the UI thread
+    E.findEvent = 1;
+}
+
+void findStop(struct findResults *f)
+{
+    struct findJob *job = f->job;
+    if (job == NULL) { return; }
+
+    __atomic_store_n(&job->cancel, 1, __ATOMIC_RELAXED);
+    for (int j = 0; j < job->nthreads; j++) { pthread_join(job->threads[j], NULL); }
+    for (int j = 0; j < job->nitems; j++) { free(job->items[j].found.m); }
+    free(job->items);
+    free(job->query);
+    close(job->wake[0]);
+    close(job->wake[1]);
+    free(job);
+    f->job = NULL;
+}
+
+// query longer than the previous one: only its matches can still match
+void findNarrow(struct findResults *f)
+{
+    int n = 0;
+    for (int j = 0; j < f->list.n; j++)
+    {
+	size_t len;
+	struct findMatch *m = &f->list.m[j];
+	char *s = editorLineChars(m->row, &len);
+	if (m->col + (size_t)f->qlen <= len && !memcmp(&s[m->col], f->query, f->qlen))
+	    f->list.m[n++] = *m;
+    }
+    f->list.n = n;
+}
+
+void editorFindJump()
+{
+    struct findResults *f = &E.find;
+    if (f->list.n == 0) { return; }
+
+    E.cy = f->list.m[f->cur].row;
+    E.cx = f->list.m[f->cur].col; 
+    E.rowOffset = E.numTextRows; // match on the top of the screen
+}
+
+// results for a new query, 0 if the query didn't change
+int editorFindUpdate(char *query)
+{
+    struct findResults *f = &E.find;
+    int qlen = strlen(query);
+    int same = f->query && !strcmp(query, f->query);
+    int grown = f->query && f->qlen > 0 && qlen >= f->qlen && !strncmp(query, f->query, f->qlen);
+
+    if (same) { return 0; }
+    if (f->job || f->regex) // results not complete, or a longer regex is not a narrower one
+    {
+	findStop(f);
+	grown = 0;
     }
 
-    int len;
-    char *buf = editorRowsToString(&len);
+    free(f->query);
+    f->query = strdup(query);
+    if (f->query == NULL) { die("strdup"); }
+    f->qlen = qlen;
+    reFree(f->re);
+    f->re = NULL;
+    if (f->regex && qlen) { f->re = reCompile(query); }
+
+    if (qlen == 0 || (f->regex && f->re == NULL)) { f->list.n = 0; }
+    else if (grown) { findNarrow(f); }
+    else if (E.numTextRows >= KILO_FIND_ROWS) { findStart(f); }
+    else { findScan(f); }
+    return 1;
+}
+
+// the workers woke up the UI: results of the items done in order are moved in the list,
+// the cursor goes to the first hit as soon as it's known
+void editorFindCheck()
+{
+    struct findResults *f = &E.find;
+    struct findJob *job = f->job;
+    E.findEvent = 0;
+    if (job == NULL) { return; }
+
+    char drain[64];
+    while (read(job->wake[0], drain, sizeof(drain)) > 0) {}
+
+    int had = f->list.n;
+    while (job->merged < job->nitems && __atomic_load_n(&job->items[job->merged].done, __ATOMIC_ACQUIRE))
+    {
+	struct findList *found = &job->items[job->merged].found;
+	for (int j = 0; j < found->n; j++) { findPush(&f->list, found->m[j].row, found->m[j].col, found->m[j].len); }
+	free(found->m);
+	found->m = NULL;
+	job->merged++;
+    }
 
-    // O_CREAT = create if doesn't exists      // O_RDWR = open for read and write
-    // 0644 = standard permission for text files( Owner permission read/write, others read only)
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1)
+    if (had == 0 && f->list.n) 
     { 
-	if (ftruncate(fd, len) != -1)// set file size, ( safer then O_TRUNC ) 
-	{
-	    if ( write(fd, buf, len) == len)
-	    {
-		close(fd);
-		free(buf);
-		E.dirty = 0; //cause called editorInsertRow()
-		editorSetStatusMessage("%d bytes written to disk", len);
-		return;
-	    }
-	}
-	close(fd);
+	f->cur = 0;
+	editorFindJump();
     }
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    if (job->merged == job->nitems) { findStop(f); }
 }
 
+void editorFindClear()
+{
+    struct findResults *f = &E.find;
+    int regex = f->regex; // the mode is kept for the next search
+    findStop(f);
+    free(f->query);
+    free(f->list.m);
+    reFree(f->re);
+    memset(f, 0, sizeof(*f));
+    f->regex = regex;
+}
 
-/********* Find *********************************************************/
-void editorFindCallback(char *query, int key)
+// matches of the row shown at screen row y get HL_MATCH
+void editorFindOverlay(struct editorGrid *g, int y, int at, erow *row)
 {
-    static int last_match = -1; // row index of last match
-    static int direction = 1;   // 1 = forward, -1 = backward
-				
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
+    struct findList *l = &E.find.list;
+
+    int lo = 0, hi = l->n; // first match of the row
+    while (lo < hi)
+    {
+	int mid = (lo + hi) / 2;
+	if (l->m[mid].row < at) { lo = mid + 1; }
+	else { hi = mid; }
+    }
 
-    if (saved_hl) // restore status from previous match
+    for (; lo < l->n && l->m[lo].row == at; lo++)
     {
-	memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rendersize);
-	free(saved_hl);
-	saved_hl = NULL;
+	int from = editorRowCxToRx(row, l->m[lo].col) - E.colOffset;
+	int to = editorRowCxToRx(row, l->m[lo].col + l->m[lo].len) - E.colOffset;
+	if (from < 0) { from = 0; }
+	if (to > g->cols) { to = g->cols; }
+	if (to > from) { memset(&g->style[y * g->cols + from], HL_MATCH, to - from); }
     }
+}
+
+void editorFindCallback(char *query, int key)
+{
+    struct findResults *f = &E.find;
+    int n = f->list.n;
 
     if (key == '\r' || key == '\x1b')
     {
-	last_match = -1;
-	direction = 1;
+	editorFindClear();
 	return; 
     }
     else if (key == ARROW_RIGHT || key == ARROW_DOWN) 
     {
-	direction = 1;
+	if (n) { f->cur = (f->cur + 1) % n; }
     }
     else if (key == ARROW_LEFT || key == ARROW_UP) 
     {
-	direction = -1;
+	if (n) { f->cur = (f->cur - 1 + n) % n; }
     }
-    else 
+    else if (key == CTRL_KEY('r')) // regex mode on/off: search again
     {
-	last_match = -1;
-	direction = 1;
+	findStop(f);
+	f->regex = !f->regex;
+	free(f->query);
+	f->query = NULL;
+	editorFindUpdate(query);
+	f->cur = 0;
     }
-
-    if (last_match == -1) { direction = 1; }
-    int current = last_match; // index of current row searched
-
-    int i;
-    for (i = 0; i < E.numTextRows; i++)
-    {
-	current += direction;
-	// go from end of file to beginning and vice versa. 
-	if (current == -1) { current = E.numTextRows - 1; }
-	else if (current == E.numTextRows) { current = 0; }
-
-	erow *row = &E.row[current];
-	// pointer to first occurrence of substring in string
-	char *match = strstr(row->render, query);
-	if (match)
-	{
-	    last_match = current; // when find match, set last to current 
-	    E.cy = current;
-	    E.cx = editorRowRxToCx(row, match - row->render); 
-	    E.rowOffset = E.numTextRows;
-
-	    saved_hl_line = current;
-	    saved_hl = malloc(row->rendersize);
-	    memcpy(saved_hl, row->hl, row->rendersize);
-	    memset(&row->hl[match - row->render], HL_MATCH, strlen(query)); // color bytes of query (match - row->render = offset in render)	
-	    break;
-	}
+    else if (editorFindUpdate(query))
+    {
+	f->cur = 0;
     }
+
+    editorFindJump();
 }
 
 void editorFind()
@@ -877,7 +4912,7 @@ void editorFind()
     int saved_colOff = E.colOffset;
     int saved_rowOff = E.rowOffset;
 
-    char *query = editorPrompt("Search: %s  (Use ESC/Arrows/Enter)", editorFindCallback);
+    char *query = editorPrompt("Search: %s  (Use ESC/Arrows/Enter, Ctrl-R regex)", editorFindCallback);
 
     if (query)  
     { 
@@ -899,20 +4934,37 @@ struct abuf
 {
     char *b;
     int len;
+    int cap;    // allocated bytes ( doubled when full )
+    int allocs; // n° of realloc() since the last abReset()
 };
 
-#define ABUF_INIT { NULL, 0}
+#define ABUF_INIT { NULL, 0, 0, 0 }
 
 void abAppend(struct abuf *ab, const char *s, int len)
 {
-    char *newb = realloc(ab->b, ab->len + len);
-    if (newb == NULL)  { return; } 
+    if (ab->len + len > ab->cap)
+    {
+	int cap = ab->cap ? ab->cap * 2 : 4096;
+	while (cap < ab->len + len) { cap *= 2; }
+
+	char *newb = realloc(ab->b, cap);
+	if (newb == NULL)  { return; } 
+	ab->b = newb;
+	ab->cap = cap;
+	ab->allocs++;
+    }
 
-    memcpy(&newb[ab->len], s, len);
-    ab->b = newb;
+    memcpy(&ab->b[ab->len], s, len);
     ab->len += len;
 }
 
+// empty the buffer keeping the memory ( reused for every frame )
+void abReset(struct abuf *ab)
+{
+    ab->len = 0;
+    ab->allocs = 0;
+}
+
 void abFreee(struct abuf *ab)
 {
     free(ab->b);
@@ -977,7 +5029,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int))
 
 void editorMoveCursor(int key)
 {
-    erow *row = (E.cy >= E.numTextRows) ? NULL : &E.row[E.cy]; // current row
+    erow *row = editorRowAt(E.cy); // current row ( NULL past the last line )
 
     switch (key)
     {
@@ -991,7 +5043,7 @@ void editorMoveCursor(int key)
 	    {
 		// from begin line to end previous line 
 		E.cy--;
-		E.cx = E.row[E.cy].size;
+		E.cx = editorRowAt(E.cy)->size;
 	    }
 	    break;
 	}
@@ -1029,19 +5081,93 @@ void editorMoveCursor(int key)
     }
 
     // stop cursor on end of line (for every line) 
-    row = (E.cy >= E.numTextRows) ? NULL : &E.row[E.cy];
+    row = editorRowAt(E.cy);
     int rowLen  = row ? row->size : 0;
     if (E.cx > rowLen) { E.cx = rowLen; }
 }
 
+// bytes waiting to be decoded, stdin checked without blocking if the ring is empty
+int inputPending()
+{
+    if (E.inLen == 0) { inputFill(0); }
+    return E.inLen;
+}
+
+// text typed or pasted faster than a frame ( already in the input ) goes in with a single edit
+void editorInsertBurst(int c)
+{
+    struct abuf text = ABUF_INIT;
+    char ch = c;
+    abAppend(&text, &ch, 1);
+
+    while (inputPending())
+    {
+	ch = E.inBuf[E.inHead];
+	if (iscntrl((unsigned char)ch) && ch != '\t' && ch != '\r' && ch != '\n') { break; } // a key to process on its own
+	abAppend(&text, &ch, 1);
+	inputByte(0);
+    }
+
+    editorInsertText(text.b, text.len);
+    abFreee(&text);
+}
+
+// bracketed paste: everything up to <esc>[201~ is text, control keys too
+void editorPaste()
+{
+    struct abuf text = ABUF_INIT;
+
+    while (1)
+    {
+	int c = inputByte(KILO_PASTE_WAIT);
+	if (c == -1) 
+	{ 
+	    if (E.winChanged) 
+	    { 
+		editorResize(); 
+		continue; 
+	    }
+	    break; // the end of the paste got lost: what arrived is inserted
+	}
+
+	char ch = c;
+	abAppend(&text, &ch, 1);
+	if (text.len >= 6 && !memcmp(&text.b[text.len - 6], "\x1b[201~", 6)) 
+	{ 
+	    text.len -= 6; 
+	    break; 
+	}
+    }
+
+    editorInsertText(text.b, text.len);
+    abFreee(&text);
+}
+
 void editorProcessKeypress()
 {
     static int quit_times = KILO_QUIT_TIMES;
 
     int c = editorReadKey();
 
+    // typed chars and deleted chars one after the other are undone together
+    int kind = 0;
+    if (c == '\t' || (c >= 32 && c < 256 && c != BACKSPACE)) { kind = 1; }
+    else if (c == BACKSPACE || c == CTRL_KEY('h') || c == DEL_KEY) { kind = 2; }
+    if (kind == 0 || kind != E.undoKind) { editorUndoBreak(); }
+    E.undoKind = kind;
+
     switch (c) 
     {
+	case CTRL_KEY('z'):
+	{
+	    editorUndo();
+	}
+	break;
+	case CTRL_KEY('y'):
+	{
+	    editorRedo();
+	}
+	break;
 	case '\r': // <Enter>
 	{
 	    editorInsertNewLine();
@@ -1049,6 +5175,7 @@ void editorProcessKeypress()
 	break;
 	case CTRL_KEY('q'):
 	{
+	    editorSaveCheck(1); // a save in progress is finished first
 	    if (E.dirty && quit_times > 0)
 	    {
 		editorSetStatusMessage("Warning!!! File has unsaved changes. " 
@@ -1074,7 +5201,7 @@ void editorProcessKeypress()
 	case END_KEY:
 	{
 	    if (E.cy < E.numTextRows)
-		E.cx = E.row[E.cy].size;
+		E.cx = editorRowAt(E.cy)->size;
 	}
         break;
 	case CTRL_KEY('f'):
@@ -1122,8 +5249,19 @@ void editorProcessKeypress()
 	    // - ignore Escape key, cause in editorReadKey() not mapped key(f1, f2,...)will be equivalent to <esc>
 	    break;
 
+	case PASTE_START:
+	{
+	    editorPaste();
+	}
+	break;
+	case PASTE_END:
+	    break;
+
 	default:
-	    editorInsertChar(c);
+	    if (c == '\t' || (c >= 32 && c < 256 && c != BACKSPACE))
+		editorInsertBurst(c);
+	    else
+		editorInsertChar(c);
 	    break;
     }
 
@@ -1137,7 +5275,7 @@ void editorScroll()
 {
     E.rx = 0;
     if (E.cy < E.numTextRows)
-	E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+	E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
 
     if (E.cy < E.rowOffset)
 	E.rowOffset = E.cy;
@@ -1152,15 +5290,99 @@ void editorScroll()
 	E.colOffset = E.rx - E.screenCols +1;
 }
 
-void editorDrawRows(struct abuf *ab)
+// put "len" chars of "s" in row "y" of the frame from column "x" ( cut at the right border )
+void gridPut(struct editorGrid *g, int y, int x, const char *s, int len, int style)
+{
+    if (x + len > g->cols) { len = g->cols - x; }
+    if (len <= 0) { return; }
+
+    memcpy(&g->chars[y * g->cols + x], s, len);
+    memset(&g->style[y * g->cols + x], style, len);
+}
+
+void gridFill(struct editorGrid *g, int y, int x, char c, int len, int style)
+{
+    if (x + len > g->cols) { len = g->cols - x; }
+    if (len <= 0) { return; }
+
+    memset(&g->chars[y * g->cols + x], c, len);
+    memset(&g->style[y * g->cols + x], style, len);
+}
+
+int isCtrlByte(char c)
+{
+    return (c >= 0 && c < 32) || c == 127;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 16 cells at a time: a bit of the mask is a control byte
+__attribute__((target("sse2")))
+int renderSpanSSE2(const char *c, int len)
+{
+    __m128i space = _mm_set1_epi8(32);
+    __m128i del = _mm_set1_epi8(127);
+    __m128i neg = _mm_set1_epi8(-1);
+    int i;
+    for (i = 0; i + 16 <= len; i += 16)
+    {
+	__m128i v = _mm_loadu_si128((const __m128i *)(c + i));
+	__m128i ctrl = _mm_and_si128(_mm_cmpgt_epi8(v, neg), _mm_cmplt_epi8(v, space));
+	ctrl = _mm_or_si128(ctrl, _mm_cmpeq_epi8(v, del));
+	unsigned int stop = _mm_movemask_epi8(ctrl);
+	if (stop) { return i + __builtin_ctz(stop); }
+    }
+    for (; i < len; i++)
+    {
+	if (isCtrlByte(c[i])) { return i; }
+    }
+    return len;
+}
+#endif
+
+// n° of cells from the start with no control byte ( 0 if c[0] is one )
+int renderSpan(const char *c, int len)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return renderSpanSSE2(c, len);
+#else
+    int i;
+    for (i = 0; i < len; i++)
+    {
+	if (isCtrlByte(c[i])) { return i; }
+    }
+    return len;
+#endif
+}
+
+// text and runs to draw "len" cells of a row from column "col": the text starts at "col", 
+// the runs at column "*at" ( a long row gives the window around the screen ). A row not 
+// highlighted ( yet ) has no runs
+char *editorRowView(erow *row, int col, int len, unsigned char **run, unsigned char **runEnd, int *at)
+{
+    if (row->wide && len > 0)
+    {
+	struct longRow *w = editorLongWindow(row, col, len);
+	*run = w->winRuns;
+	*runEnd = w->winRuns + w->winRunsLen * 2;
+	*at = w->winFrom;
+	return w->winText + col - w->winFrom;
+    }
+
+    *run = row->hl;
+    *runEnd = row->hl_valid ? row->hl + row->hlRuns * 2 : row->hl;
+    *at = 0;
+    return editorRowRender(row) + col;
+}
+
+void editorDrawRows(struct editorGrid *g)
 {
     int y;
     for (y = 0; y < E.screenRows; y++)
     {
 	int filerow = y + E.rowOffset; 
-	
 	if (filerow >= E.numTextRows)
 	{
+	    gridFill(g, y, 0, ' ', E.screenCols, HL_NORMAL);
 	    if (E.numTextRows == 0 && y == E.screenRows / 3)
 	    {
 		char welcome[80];
@@ -1168,90 +5390,72 @@ void editorDrawRows(struct abuf *ab)
 		if (welcomeLen > E.screenCols) { welcomeLen = E.screenCols; }
 	    
 		int padding = (E.screenCols - welcomeLen) / 2;
-		if (padding)
-		{
-		    abAppend(ab, "~", 1);
-		    padding--;
-		}
-		while (padding--) { abAppend(ab, " ", 1); }
-		abAppend(ab, welcome, welcomeLen);
+		if (padding) { gridPut(g, y, 0, "~", 1, HL_NORMAL); }
+		gridPut(g, y, padding, welcome, welcomeLen, HL_NORMAL);
 	    }
 	    else 
 	    { 
-		abAppend(ab, "~", 1);
+		gridPut(g, y, 0, "~", 1, HL_NORMAL);
 	    }
 	}
 	else 
 	{  
-	    int len = E.row[filerow].rendersize - E.colOffset;
+	    erow *row = editorRowAt(filerow);
+	    int len = row->rendersize - E.colOffset;
 	    if (len < 0) { len = 0; }
 	    if (len > E.screenCols) { len = E.screenCols; }
 
-	    char *c = &E.row[filerow].render[E.colOffset];
-	    unsigned char *hl = &E.row[filerow].hl[E.colOffset];
-	    int current_color = -1; // only print escape seq if color change (from his previous char)
-	    int j;
-	    for (j = 0; j < len; j++)
-	    {
+	    unsigned char *run, *runEnd;
+	    int at;
+	    char *c = editorRowView(row, E.colOffset, len, &run, &runEnd, &at);
+	    while (run < runEnd && at + run[0] <= E.colOffset) // first run on screen ( starting at column "at" )
+	    { 
+		at += run[0]; 
+		run += 2; 
+	    }
+
+	    // the text with one copy, then the style of every run, then the control bytes
+	    char *gc = &g->chars[y * g->cols];
+	    unsigned char *gs = &g->style[y * g->cols];
+	    memcpy(gc, c, len);
 
-		if (iscntrl(c[j]))
+	    int j = 0;
+	    while (j < len)
+	    {
+		int style = HL_NORMAL; // after the runs
+		int end = len;
+		if (run < runEnd)
 		{
-		    char num[32];
-		    int lenN = snprintf(num, sizeof(num), "%d", filerow);
-		    abAppend(ab, num, lenN );
-		    
-		    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-		    abAppend(ab, "\x1b[7m", 4);
-		    abAppend(ab, &sym, 1);
-		    abAppend(ab, "\x1b[m", 3);
-		    if (current_color != -1) // again because of [m
-		    {
-			char buf[16];
-			int clen = snprintf(buf, sizeof(buf), "\x1b[38;5;%dm", current_color);
-			abAppend(ab, buf, clen);
-		    }
+		    style = run[1];
+		    end = at + run[0] - E.colOffset;
+		    if (end > len) { end = len; }
+		    at += run[0];
+		    run += 2;
 		}
-		else if (hl[j] == HL_NORMAL)
-		{
-		    if (current_color != -1)
-		    {
-			abAppend(ab, "\x1b[39m", 5);
-			current_color = -1;
-		    }
-		    abAppend(ab, &c[j], 1);
-		}    
-		else
+		unsigned long long fill = 0x0101010101010101ull * style;
+		for (; j < end; j += 8) // 8 cells at a time: the next run writes over the extra ones
 		{
-		    int color = editorSyntaxToColor(hl[j]);		    
-		    if (color != current_color)
-		    {
-			current_color = color;
-			char buf[16];
-			//int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-			int clen = snprintf(buf, sizeof(buf), "\x1b[38;5;%dm", color);
-			abAppend(ab, buf, clen);
-		    }  
-		    abAppend(ab, &c[j], 1);
+		    if (j + 8 <= g->cols) { memcpy(&gs[j], &fill, 8); }
+		    else { memset(&gs[j], style, end - j); }
 		}
+		j = end;
+	    }
+
+	    for (j = renderSpan(c, len); j < len; j += 1 + renderSpan(&c[j + 1], len - j - 1)) 
+	    {
+		gc[j] = (c[j] <= 26) ? '@' + c[j] : '?'; // shown as ^@ ^A ... in reverse video
+		gs[j] = STYLE_CTRL;
 	    }
-	    abAppend(ab, "\x1b[39m", 5);
+	    gridFill(g, y, len, ' ', E.screenCols - len, HL_NORMAL);
+	    if (E.find.list.n) { editorFindOverlay(g, y, filerow, row); }
 	}
-	// K = erase part of line, params same as J, (0 erase part right to the cursor ) 
-	// ( refresh each line instead of all "[2J" )
-	abAppend(ab, "\x1b[K", 3);	
-        abAppend(ab, "\r\n", 2);
     }
 }
 
-void editorDrawStatusBar(struct abuf *ab)
+void editorDrawStatusBar(struct editorGrid *g)
 {
-    // "<esc>[1;4;5m" = Select Graphic Rendition, text printed after with various attrs
-    // ( 1 = bold, 4 = underscore, 5 = blink, 7 = inverted colors) "<esc>[m" = go to default
-    //abAppend(ab, "\x1b[31;7m", 7); // default red + inverted 
-    //abAppend(ab, "\x1b[48;2;226;158;202m", 19); //pink light
-    //abAppend(ab, "\x1b[38;2;0;0;0m", 13);
-    abAppend(ab, "\x1b[48;5;175m", 11);
-    abAppend(ab, "\x1b[30m", 5);
+    int y = E.screenRows;
+    gridFill(g, y, 0, ' ', E.screenCols, STYLE_STATUS);
     
     char status[80], rstatus[80]; // left, right
     int len = snprintf( status, 
@@ -1266,41 +5470,32 @@ void editorDrawStatusBar(struct abuf *ab)
 			E.syntax ? E.syntax->filetype : "no filetype",
 			E.cy + 1, 
 			E.numTextRows);
+    if (E.find.qlen && E.find.regex && E.find.re == NULL)
+	rlen = snprintf(rstatus, sizeof(rstatus), "| bad regex | %d/%d ", E.cy + 1, E.numTextRows);
+    else if (E.find.qlen) // search in progress ( "+" = still counting )
+	rlen = snprintf(rstatus, sizeof(rstatus), "| %smatch %d of %d%s | %d/%d ", 
+			E.find.regex ? "regex " : "", E.find.list.n ? E.find.cur + 1 : 0, 
+			E.find.list.n, E.find.job ? "+" : "", E.cy + 1, E.numTextRows);
+    else if (E.frameStats) // output of the last frame ( KILO_FRAME_STATS set )
+	rlen = snprintf(rstatus, sizeof(rstatus), "| %d B %d allocs | %d/%d ", 
+			E.frameBytes, E.frameAllocs, E.cy + 1, E.numTextRows);
 
     if (len > E.screenCols) { len = E.screenCols; }
-    abAppend(ab, status, len);
-
-    while (len < E.screenCols)
-    {
-	if (E.screenCols - len == rlen)
-	{
-	    abAppend(ab, rstatus, rlen);
-	    break;
-	}
-	else 
-	{
-	    abAppend(ab, " ", 1);
-	    len++;
-	}
-    }
+    gridPut(g, y, 0, status, len, STYLE_STATUS);
 
-    abAppend(ab, "\x1b[39m", 5);
-    //abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
+    if (E.screenCols - len >= rlen) // right part only if there is space
+	gridPut(g, y, E.screenCols - rlen, rstatus, rlen, STYLE_STATUS);
 }
 
-void editorDrawMessageBar(struct abuf *ab)
+void editorDrawMessageBar(struct editorGrid *g)
 {
-    abAppend(ab, "\x1b[48;5;233m", 11); 
-    abAppend(ab, "\x1b[K", 3); // clear the message bar
+    int y = E.screenRows + 1;
+    gridFill(g, y, 0, ' ', E.screenCols, HL_NORMAL); // clear the message bar
     
     int msglen = strlen(E.statusMsg);
     if (msglen > E.screenCols) { msglen = E.screenCols; }
-    if (msglen && time(NULL) - E.statusMsg_time < 5) // if less than 5 seconds old (and key pressed)
-    {
-	abAppend(ab, " ", 1);
-	abAppend(ab, E.statusMsg, msglen);
-    }    
+    if (msglen && time(NULL) - E.statusMsg_time < KILO_MSG_SECONDS) // if less than 5 seconds old
+	gridPut(g, y, 1, E.statusMsg, msglen, HL_NORMAL);
 }
 
 void editorSetStatusMessage(const char *fmt, ...)
@@ -1313,19 +5508,133 @@ void editorSetStatusMessage(const char *fmt, ...)
     E.statusMsg_time = time(NULL); // get current time (unix time)
 }
 
+// escapes of every style, made once by editorStyleInit()
+struct sgrCode
+{
+    char s[24];
+    int len;
+};
+
+struct sgrCode sgrFull[STYLE_COUNT];  // set every attribute
+struct sgrCode sgrColor[STYLE_COUNT]; // only the foreground ( between text styles )
+
+// "Select Graphic Rendition" escape to go from style "from" to "style"
+int editorStyleSGR(int from, int style, char *buf, int size)
+{
+    // "<esc>[1;4;5m" = Select Graphic Rendition, text printed after with various attrs
+    // ( 1 = bold, 4 = underscore, 5 = blink, 7 = inverted colors) 0 = go to default
+    // 38;5;n / 48;5;n = foreground / background from the 256 colors
+    if (from >= 0 && from <= HL_MATCH && style <= HL_MATCH) // text to text: only the color changes
+    {
+	if (style == HL_NORMAL) { return snprintf(buf, size, "\x1b[39m"); }
+	return snprintf(buf, size, "\x1b[38;5;%dm", editorSyntaxToColor(style));
+    }
+
+    switch (style)
+    {
+	case STYLE_STATUS: return snprintf(buf, size, "\x1b[0;30;48;5;175m");
+	case STYLE_CTRL: return snprintf(buf, size, "\x1b[0;7;48;5;233m");
+	case HL_NORMAL: return snprintf(buf, size, "\x1b[0;48;5;233m");
+	default: return snprintf(buf, size, "\x1b[0;38;5;%d;48;5;233m", editorSyntaxToColor(style));
+    }
+}
+
+void editorStyleInit()
+{
+    for (int style = 0; style < STYLE_COUNT; style++)
+    {
+	sgrFull[style].len = editorStyleSGR(-1, style, sgrFull[style].s, sizeof(sgrFull[style].s));
+	sgrColor[style].len = editorStyleSGR(HL_NORMAL, style, sgrColor[style].s, sizeof(sgrColor[style].s));
+    }
+}
+
+void abAppendStyle(struct abuf *ab, int from, int style)
+{
+    struct sgrCode *sgr = (from >= 0 && from <= HL_MATCH && style <= HL_MATCH) ? &sgrColor[style] : &sgrFull[style];
+    abAppend(ab, sgr->s, sgr->len);
+}
+
+// send to the terminal only the cells of the frame that changed since the last one
+void editorFlushGrid(struct abuf *ab)
+{
+    struct editorGrid *g = &E.frame;
+    struct editorGrid *s = &E.shown;
+    int style = -1;
+    int y, x;
+
+    if (!E.shownValid) // nothing known on screen (start, resize): every cell is different
+    {
+	memset(s->style, 0xff, g->rows * g->cols);
+	E.shownValid = 1;
+    }
+
+    for (y = 0; y < g->rows; y++)
+    {
+	char *c = &g->chars[y * g->cols];
+	unsigned char *st = &g->style[y * g->cols];
+	char *sc = &s->chars[y * g->cols];
+	unsigned char *sst = &s->style[y * g->cols];
+
+	if (!memcmp(c, sc, g->cols) && !memcmp(st, sst, g->cols)) { continue; }
+
+	x = 0;
+	while (x < g->cols)
+	{
+	    if (c[x] == sc[x] && st[x] == sst[x]) 
+	    { 
+		x++; 
+		continue; 
+	    }
+
+	    // a span of changed cells ( short runs of same cells inside are cheaper than a new <esc>[H )
+	    int end = x + 1;
+	    int same = 0;
+	    while (end < g->cols && same < 8)
+	    {
+		same = (c[end] == sc[end] && st[end] == sst[end]) ? same + 1 : 0;
+		end++;
+	    }
+	    end -= same;
+
+	    char buf[32];
+	    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+	    abAppend(ab, buf, len);
+	    while (x < end) // a run of cells with the same style is copied at once
+	    {
+		int run = x + 1;
+		while (run < end && st[run] == st[x]) { run++; }
+
+		if (st[x] != style)
+		{
+		    abAppendStyle(ab, style, st[x]);
+		    style = st[x];
+		}
+		abAppend(ab, &c[x], run - x);
+		x = run;
+	    }
+	}
+    }
+
+    // the frame is now on screen, the old one is drawn over next time
+    struct editorGrid tmp = E.shown;
+    E.shown = E.frame;
+    E.frame = tmp;
+}
+
 void editorRefreshScreen()
 {
     editorScroll();
+    editorSyntaxViewport();
 
-    struct abuf ab = ABUF_INIT;
+    static struct abuf ab = ABUF_INIT; // kept for the next frames
+    abReset(&ab);
 
     abAppend(&ab, "\x1b[?25l", 6); // h, l = turn on/turn of features(?25 cursor)
-    abAppend(&ab, "\x1b[H", 3);
 
-    abAppend(&ab, "\x1b[48;5;233m", 11); // 234
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab); 
+    editorDrawRows(&E.frame);
+    editorDrawStatusBar(&E.frame);
+    editorDrawMessageBar(&E.frame); 
+    editorFlushGrid(&ab);
     abAppend(&ab, "\x1b[0m", 4);
 
     char buf[32];
@@ -1334,7 +5643,233 @@ void editorRefreshScreen()
     abAppend(&ab, "\x1b[?25h", 6);
 
     write(STDOUT_FILENO, ab.b, ab.len);
-    abFreee(&ab);
+    E.frameBytes = ab.len;
+    E.frameAllocs = ab.allocs;
+}
+
+// frame buffers for the current terminal size
+void editorGridResize()
+{
+    int rows = E.screenRows + 2; // + status bar and message bar
+    int cols = E.screenCols;
+    struct editorGrid *grids[2] = { &E.frame, &E.shown };
+
+    for (int j = 0; j < 2; j++)
+    {
+	struct editorGrid *g = grids[j];
+	g->rows = rows;
+	g->cols = cols;
+	g->chars = realloc(g->chars, rows * cols);
+	g->style = realloc(g->style, rows * cols);
+	if (g->chars == NULL || g->style == NULL) { die("realloc"); }
+    }
+    E.shownValid = 0;
+}
+
+// terminal resized ( SIGWINCH ): new grids, the whole frame is sent again
+void editorResize()
+{
+    E.winChanged = 0;
+    if (getWindowSize(&E.screenRows, &E.screenCols) == -1) { die("getWindowSize"); }
+    E.screenRows -= 2;
+    if (E.screenRows < 1) { E.screenRows = 1; }
+    editorGridResize();
+}
+
+
+/*************************************************************************/
+/********* Benchmark *****************************************************/
+// KILO_BENCH=1 ./kilo file ( make bench ): parts of the editor timed on "file", no terminal
+
+double benchNow()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// rows drawn a cell at a time from "text" and "hl" of every row, as before the spans
+void benchDrawCells(struct editorGrid *g, char **text, unsigned char **hl, int *len)
+{
+    for (int y = 0; y < E.screenRows; y++)
+    {
+	int filerow = y + E.rowOffset;
+	gridFill(g, y, 0, ' ', E.screenCols, HL_NORMAL);
+	if (filerow >= E.numTextRows) 
+	{ 
+	    gridPut(g, y, 0, "~", 1, HL_NORMAL);
+	    continue; 
+	}
+
+	char *c = text[filerow] + E.colOffset;
+	int n = len[filerow] - E.colOffset;
+	if (n > E.screenCols) { n = E.screenCols; }
+	for (int j = 0; j < n; j++)
+	{
+	    if (iscntrl(c[j]))
+	    {
+		char sym = (c[j] <= 26) ? '@' + c[j] : '?';
+		gridPut(g, y, j, &sym, 1, STYLE_CTRL);
+	    }
+	    else
+	    {
+		gridPut(g, y, j, &c[j], 1, hl[filerow][E.colOffset + j]);
+	    }
+	}
+    }
+}
+
+// the rows of the file drawn page after page, by cells and by spans ( editorDrawRows() )
+void benchRender()
+{
+    int n = E.numTextRows;
+    char **text = malloc(n * sizeof(char *));
+    unsigned char **hl = malloc(n * sizeof(unsigned char *));
+    int *len = malloc(n * sizeof(int));
+    if (text == NULL || hl == NULL || len == NULL) { die("malloc"); }
+
+    for (E.rowOffset = 0; E.rowOffset < n; E.rowOffset += E.screenRows) { editorSyntaxViewport(); }
+    for (int j = 0; j < n; j++) // cells of the rows ( long rows are left out )
+    {
+	erow *row = editorRowAt(j);
+	len[j] = row->wide ? 0 : row->rendersize;
+	text[j] = malloc(len[j] + 1);
+	hl[j] = malloc(len[j] + 1);
+	if (text[j] == NULL || hl[j] == NULL) { die("malloc"); }
+	memcpy(text[j], editorRowRender(row), len[j]);
+	editorRowCells(row, 0, len[j], hl[j]);
+    }
+
+    double t[2];
+    int diff = 0;
+    for (int k = 0; k < 2; k++)
+    {
+	double t0 = benchNow();
+	for (int f = 0; f < KILO_BENCH_FRAMES; f++)
+	{
+	    E.rowOffset = (f * E.screenRows) % (n ? n : 1);
+	    if (k == 0) { benchDrawCells(&E.frame, text, hl, len); }
+	    else { editorDrawRows(&E.frame); }
+	}
+	t[k] = benchNow() - t0;
+    }
+
+    for (E.colOffset = 0; E.colOffset < 64; E.colOffset += 7) // same frames ( scrolled too )
+    {
+	for (E.rowOffset = 0; E.rowOffset < n; E.rowOffset += E.screenRows)
+	{
+	    benchDrawCells(&E.shown, text, hl, len);
+	    editorDrawRows(&E.frame);
+	    for (int y = 0; y < E.screenRows && y + E.rowOffset < n; y++)
+	    {
+		int at = y * E.screenCols;
+		if (editorRowAt(y + E.rowOffset)->wide) { continue; }
+		diff += memcmp(&E.frame.chars[at], &E.shown.chars[at], E.screenCols) || 
+			memcmp(&E.frame.style[at], &E.shown.style[at], E.screenCols);
+	    }
+	}
+    }
+
+    printf("render %d frames of %dx%d: cells %.2f us, spans %.2f us a frame ( x%.1f )%s\n",
+	   KILO_BENCH_FRAMES, E.screenRows, E.screenCols, t[0] * 1e6 / KILO_BENCH_FRAMES, 
+	   t[1] * 1e6 / KILO_BENCH_FRAMES, t[1] > 0 ? t[0] / t[1] : 0, diff ? ", DIFFERENT FRAMES" : "");
+
+    for (int j = 0; j < n; j++) 
+    { 
+	free(text[j]); 
+	free(hl[j]); 
+    }
+    free(text);
+    free(hl);
+    free(len);
+    E.rowOffset = E.colOffset = 0;
+}
+
+// matches of "q" ( literal or regex ) in the buffer, or in "nrows" rows if "rows" isn't NULL. 
+// The time of a search in "*secs"
+int benchFind(const char *q, int regex, erow *rows, int nrows, double *secs)
+{
+    struct findResults f;
+    struct reMatcher matcher;
+    memset(&f, 0, sizeof(f));
+    f.query = (char *)q;
+    f.qlen = strlen(q);
+    f.regex = regex;
+    f.re = regex ? reCompile(q) : NULL;
+    if (regex && f.re == NULL) { die("reCompile"); }
+    if (rows && f.re) { reMatcherInit(&matcher, f.re); }
+
+    int runs = rows ? 1 : KILO_BENCH_RUNS;
+    double t0 = benchNow();
+    for (int k = 0; k < runs; k++)
+    {
+	f.list.n = 0;
+	if (rows) { findScanRows(&f.list, f.query, f.qlen, f.re ? &matcher : NULL, rows, 0, nrows); }
+	else { findScan(&f); }
+    }
+    *secs = (benchNow() - t0) / runs;
+
+    if (rows && f.re) { reMatcherFree(&matcher); }
+    reFree(f.re);
+    free(f.list.m);
+    return f.list.n;
+}
+
+// a regex against the literal search of "lit" ( the same query, or one with the same matches )
+void benchFindPair(const char *what, const char *lit, const char *q, erow *rows, int nrows)
+{
+    double tl, tr;
+    int nl = benchFind(lit, 0, rows, nrows, &tl);
+    int nr = benchFind(q, 1, rows, nrows, &tr);
+    printf("find %-24s literal \"%s\" %.2f ms ( %d ), regex \"%s\" %.2f ms ( %d ): x%.1f\n", 
+	   what, lit, tl * 1e3, nl, q, tr * 1e3, nr, tl > 0 ? tr / tl : 0);
+}
+
+// regex search against the literal one on the file, then on long lines with a match at every byte
+void benchSearch()
+{
+    benchFindPair("in the file", "e", "e", NULL, 0);
+    benchFindPair("in the file", "struct", "struct", NULL, 0);
+    benchFindPair("in the file", "editorRow", "editorRow", NULL, 0);
+    benchFindPair("in the file", "int", "in[t]", NULL, 0);
+
+    char *s = malloc(KILO_BENCH_LINE);
+    if (s == NULL) { die("malloc"); }
+    erow row;
+    memset(&row, 0, sizeof(row));
+    row.chars = s;
+    row.size = KILO_BENCH_LINE;
+
+    memset(s, 'e', KILO_BENCH_LINE);
+    benchFindPair("in a line of e", "e", "e", &row, 1);
+    benchFindPair("in a line of e", "e", "e+", &row, 1);
+    benchFindPair("in a line of e", "e", "e|x", &row, 1);
+    benchFindPair("in a line of e", "e", "e?", &row, 1);
+    for (int j = 0; j < KILO_BENCH_LINE; j++) { s[j] = "ab"[j & 1]; }
+    benchFindPair("in a line of ab", "a", "a*", &row, 1);
+    benchFindPair("in a line of ab", "a", "(a*)*", &row, 1);
+    benchFindPair("in a line of ab", "ab", "(ab)+|x*", &row, 1);
+    free(s);
+}
+
+int editorBench(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+	fprintf(stderr, "usage: KILO_BENCH=1 %s <file>\n", argv[0]);
+	return 1;
+    }
+
+    initEditor();
+    editorOpen(argv[1]);
+    if (E.syntax == NULL) // highlighted as C anyway: the benchmark is about dense source
+    {
+	E.syntax = &E.syntaxes[0];
+	editorKeywordCompile(E.syntax);
+    }
+    benchRender();
+    benchSearch();
+    return 0;
 }
 
 
@@ -1348,28 +5883,82 @@ void initEditor()
     E.rowOffset = 0;
     E.colOffset = 0;
     E.numTextRows = 0;
-    E.row = NULL;
+    E.rowTree = NULL;
+    memset(&E.heap, 0, sizeof(E.heap));
+    E.map = NULL;
+    E.mapSize = 0;
+    E.lineIndex = NULL;
+    E.hlFrontier = 0;
+    E.hlState = (struct hlState){ 0, 0 };
+    E.hlCheckpoint = NULL;
+    E.hlCheckpointCap = 0;
+    E.hlLine = NULL;
+    E.hlLineCap = 0;
+    E.hlJob = NULL;
+    E.hlEvent = 0;
     E.dirty = 0;
     E.filename = NULL;
     E.statusMsg[0] = '\0';
     E.statusMsg_time = 0;
+    E.inHead = 0;
+    E.inLen = 0;
+    E.winChanged = 0;
+    enableResizeEvents();
+    E.save = NULL;
+    E.snapGen = 0;
+    E.kept = NULL;
+    E.nkept = 0;
+    E.keptCap = 0;
+    E.syntaxes = NULL;
+    E.nsyntaxes = 0;
+    E.syntaxHash = NULL;
+    E.syntaxHashSize = 0;
+    E.saveEvent = 0;
+    E.findEvent = 0;
+    memset(&E.find, 0, sizeof(E.find));
+    memset(&E.undo, 0, sizeof(E.undo));
+    memset(&E.redo, 0, sizeof(E.redo));
+    E.undoGroupAt = 0;
+    E.undoOpen = 0;
+    E.undoLock = 0;
+    E.undoSeq = 0;
+    E.undoPos = 0;
+    E.undoSaved = 0;
+    E.undoSkip = 0;
+    E.undoKind = 0;
+    E.undoCx = E.undoCy = 0;
     E.syntax = NULL;
-
-    if (getWindowSize(&E.screenRows, &E.screenCols) == -1) { die("getWindowSize"); }
+    E.frame.chars = E.shown.chars = NULL;
+    E.frame.style = E.shown.style = NULL;
+    E.frameStats = getenv("KILO_FRAME_STATS") != NULL;
+    E.frameBytes = 0;
+    E.frameAllocs = 0;
+    editorStyleInit();
+    editorSyntaxLoad();
+
+    if (getenv("KILO_BENCH")) // benchmarks don't use the terminal
+    {
+	E.screenRows = KILO_BENCH_ROWS;
+	E.screenCols = KILO_BENCH_COLS;
+    }
+    else if (getWindowSize(&E.screenRows, &E.screenCols) == -1) { die("getWindowSize"); }
 
     E.screenRows -= 2; // editorDrawRow() not at last 2 line
+    editorGridResize();
 }
 
 
 int main(int argc, char *argv[])
 {
+    if (getenv("KILO_BENCH")) { return editorBench(argc, argv); }
+
     enableRawMode();
     initEditor();
+    editorSetStatusMessage("HELP: Ctrl-S = Save | Ctrl-Q = Quit | Ctrl-F = Find | Ctrl-Z/Y = Undo/Redo");
+
     if (argc >= 2)
 	editorOpen(argv[1]);
 
-    editorSetStatusMessage("HELP: Ctrl-S = Save | Ctrl-Q = Quit | Ctrl-F = Find");
-
     while(1) 
     {
 	editorRefreshScreen();